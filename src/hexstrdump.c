@@ -1,7 +1,2035 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HEXSTRDUMP_X86
+#include <immintrin.h>
+#endif
+
+static const size_t block_size = 1 << 18;
+
+static uint32_t hex_table[256];
+static char hex_pairs[256][2];
+static char c_array_table[256][6];
+static char base64_pairs[4096][2];
+static int8_t hex_values[256];
+static int8_t base64_values[256];
 
-static char * byte2hex(uint8_t byte, char *output) {
+static void build_tables(void) {
+    static const char *digits = "0123456789ABCDEF";
+    static const char *lower = "0123456789abcdef";
+    static const char *alphabet =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 256; ++i) {
+        const char entry[4] = { '\\', 'x', digits[i / 16], digits[i % 16] };
+        memcpy(&hex_table[i], entry, sizeof(entry));
+        hex_pairs[i][0] = lower[i / 16];
+        hex_pairs[i][1] = lower[i % 16];
+        const char element[6] = { ' ', '0', 'x', lower[i / 16], lower[i % 16], ',' };
+        memcpy(c_array_table[i], element, sizeof(element));
+    }
+    for (int i = 0; i < 4096; ++i) {
+        base64_pairs[i][0] = alphabet[i >> 6];
+        base64_pairs[i][1] = alphabet[i & 63];
+    }
+    memset(hex_values, -1, sizeof(hex_values));
+    memset(base64_values, -1, sizeof(base64_values));
+    for (int i = 0; i < 16; ++i) {
+        hex_values[(uint8_t) digits[i]] = i;
+        hex_values[(uint8_t) lower[i]] = i;
+    }
+    for (int i = 0; i < 64; ++i)
+        base64_values[(uint8_t) alphabet[i]] = i;
+}
+
+typedef void (*encode_function)(const uint8_t *, size_t, char *);
+
+static void encode_scalar(const uint8_t *input, size_t length, char *output) {
+    for (size_t i = 0; i < length; ++i)
+        memcpy(output + 4 * i, &hex_table[input[i]], 4);
+}
+
+static void encode_hex_scalar(const uint8_t *input, size_t length, char *output) {
+    for (size_t i = 0; i < length; ++i)
+        memcpy(output + 2 * i, hex_pairs[input[i]], 2);
+}
+
+#ifdef HEXSTRDUMP_X86
+/* The nibbles of each byte are turned into digits with a byte shuffle, then
+ * interleaved into (high, low) pairs, and the pairs are interleaved with the
+ * constant "\x" prefix, producing one 4-byte escape per input byte. */
+__attribute__((target("ssse3")))
+static void encode_ssse3(const uint8_t *input, size_t length, char *output) {
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i prefix = _mm_set1_epi16(('x' << 8) | '\\');
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *) (input + i));
+        const __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        const __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, nibble));
+        const __m128i first = _mm_unpacklo_epi8(high, low);
+        const __m128i second = _mm_unpackhi_epi8(high, low);
+
+        __m128i *target = (__m128i *) (output + 4 * i);
+        _mm_storeu_si128(target + 0, _mm_unpacklo_epi16(prefix, first));
+        _mm_storeu_si128(target + 1, _mm_unpackhi_epi16(prefix, first));
+        _mm_storeu_si128(target + 2, _mm_unpacklo_epi16(prefix, second));
+        _mm_storeu_si128(target + 3, _mm_unpackhi_epi16(prefix, second));
+    }
+    encode_scalar(input + i, length - i, output + 4 * i);
+}
+
+/* Same as the SSSE3 variant on 32 bytes at once. The unpacking works within
+ * 128-bit lanes, so the results are reordered across lanes before storing. */
+__attribute__((target("avx2")))
+static void encode_avx2(const uint8_t *input, size_t length, char *output) {
+    const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+                                            '0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i prefix = _mm256_set1_epi16(('x' << 8) | '\\');
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i bytes = _mm256_loadu_si256((const __m256i *) (input + i));
+        const __m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        const __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(bytes, nibble));
+        const __m256i first = _mm256_unpacklo_epi8(high, low);
+        const __m256i second = _mm256_unpackhi_epi8(high, low);
+        const __m256i a = _mm256_unpacklo_epi16(prefix, first);
+        const __m256i b = _mm256_unpackhi_epi16(prefix, first);
+        const __m256i c = _mm256_unpacklo_epi16(prefix, second);
+        const __m256i d = _mm256_unpackhi_epi16(prefix, second);
+
+        __m256i *target = (__m256i *) (output + 4 * i);
+        _mm256_storeu_si256(target + 0, _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256(target + 1, _mm256_permute2x128_si256(c, d, 0x20));
+        _mm256_storeu_si256(target + 2, _mm256_permute2x128_si256(a, b, 0x31));
+        _mm256_storeu_si256(target + 3, _mm256_permute2x128_si256(c, d, 0x31));
+    }
+    encode_ssse3(input + i, length - i, output + 4 * i);
+}
+
+/* Plain hexadecimal pairs, the escape kernels without the prefix. */
+__attribute__((target("ssse3")))
+static void encode_hex_ssse3(const uint8_t *input, size_t length, char *output) {
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *) (input + i));
+        const __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        const __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, nibble));
+
+        __m128i *target = (__m128i *) (output + 2 * i);
+        _mm_storeu_si128(target + 0, _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128(target + 1, _mm_unpackhi_epi8(high, low));
+    }
+    encode_hex_scalar(input + i, length - i, output + 2 * i);
+}
+
+__attribute__((target("avx2")))
+static void encode_hex_avx2(const uint8_t *input, size_t length, char *output) {
+    const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+                                            '0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i bytes = _mm256_loadu_si256((const __m256i *) (input + i));
+        const __m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        const __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(bytes, nibble));
+        const __m256i first = _mm256_unpacklo_epi8(high, low);
+        const __m256i second = _mm256_unpackhi_epi8(high, low);
+
+        __m256i *target = (__m256i *) (output + 2 * i);
+        _mm256_storeu_si256(target + 0, _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256(target + 1, _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    encode_hex_ssse3(input + i, length - i, output + 2 * i);
+}
+#endif
+
+static encode_function select_encoder(void) {
+#ifdef HEXSTRDUMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return encode_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return encode_ssse3;
+#endif
+    return encode_scalar;
+}
+
+static encode_function select_hex_encoder(void) {
+#ifdef HEXSTRDUMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return encode_hex_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return encode_hex_ssse3;
+#endif
+    return encode_hex_scalar;
+}
+
+typedef bool (*decode_function)(const char *, size_t, uint8_t *);
+typedef bool (*gather_function)(const char *, char *);
+
+/* Decodes pairs of hexadecimal digits of either case into bytes, returning
+ * false if any of the characters is not a digit. */
+static bool decode_scalar(const char *digits, size_t length, uint8_t *output) {
+    int check = 0;
+    for (size_t i = 0; i < length; ++i) {
+        const int high = hex_values[(uint8_t) digits[2 * i]];
+        const int low = hex_values[(uint8_t) digits[2 * i + 1]];
+        check |= high | low;
+        output[i] = (uint8_t) ((high << 4) | low);
+    }
+    return check >= 0;
+}
+
+#ifdef HEXSTRDUMP_X86
+/* Characters are classified as decimal digits or letters a-f (case folded)
+ * with unsigned range checks, which also validates them, then every pair of
+ * nibbles is combined with a multiply-add and the words are packed back into
+ * bytes. */
+__attribute__((target("ssse3")))
+static __m128i hex_values_ssse3(__m128i chars, __m128i *valid) {
+    const __m128i number = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    const __m128i is_number = _mm_cmpeq_epi8(_mm_min_epu8(number, _mm_set1_epi8(9)), number);
+    const __m128i letter = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    const __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+    *valid = _mm_and_si128(*valid, _mm_or_si128(is_number, is_letter));
+    const __m128i values = _mm_or_si128(_mm_and_si128(is_number, number),
+                                        _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+    return _mm_maddubs_epi16(values, _mm_set1_epi16(0x0110));
+}
+
+__attribute__((target("ssse3")))
+static bool decode_ssse3(const char *digits, size_t length, uint8_t *output) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i valid = _mm_set1_epi8(-1);
+        const __m128i first = hex_values_ssse3(_mm_loadu_si128((const __m128i *) (digits + 2 * i)), &valid);
+        const __m128i second = hex_values_ssse3(_mm_loadu_si128((const __m128i *) (digits + 2 * i + 16)), &valid);
+        if (_mm_movemask_epi8(valid) != 0xFFFF)
+            return false;
+        _mm_storeu_si128((__m128i *) (output + i), _mm_packus_epi16(first, second));
+    }
+    return decode_scalar(digits + 2 * i, length - i, output + i);
+}
+
+__attribute__((target("avx2")))
+static __m256i hex_values_avx2(__m256i chars, __m256i *valid) {
+    const __m256i number = _mm256_sub_epi8(chars, _mm256_set1_epi8('0'));
+    const __m256i is_number = _mm256_cmpeq_epi8(_mm256_min_epu8(number, _mm256_set1_epi8(9)), number);
+    const __m256i letter = _mm256_sub_epi8(_mm256_or_si256(chars, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    const __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+    *valid = _mm256_and_si256(*valid, _mm256_or_si256(is_number, is_letter));
+    const __m256i values = _mm256_or_si256(_mm256_and_si256(is_number, number),
+                                           _mm256_and_si256(is_letter, _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+    return _mm256_maddubs_epi16(values, _mm256_set1_epi16(0x0110));
+}
+
+/* The packing works within 128-bit lanes, so the quadwords are put back in
+ * order afterwards. */
+__attribute__((target("avx2")))
+static bool decode_avx2(const char *digits, size_t length, uint8_t *output) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i valid = _mm256_set1_epi8(-1);
+        const __m256i first = hex_values_avx2(_mm256_loadu_si256((const __m256i *) (digits + 2 * i)), &valid);
+        const __m256i second = hex_values_avx2(_mm256_loadu_si256((const __m256i *) (digits + 2 * i + 32)), &valid);
+        if (_mm256_movemask_epi8(valid) != -1)
+            return false;
+        const __m256i packed = _mm256_packus_epi16(first, second);
+        _mm256_storeu_si256((__m256i *) (output + i), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    return decode_ssse3(digits + 2 * i, length - i, output + i);
+}
+
+/* Checks that 16 consecutive escapes start at the given position, and copies
+ * their digits next to each other. */
+__attribute__((target("ssse3")))
+static bool gather_escapes_ssse3(const char *text, char *digits) {
+    const __m128i mask = _mm_set1_epi32(0xFFFF);
+    const __m128i prefix = _mm_set1_epi32(('x' << 8) | '\\');
+    const __m128i select = _mm_setr_epi8(2, 3, 6, 7, 10, 11, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+    for (int i = 0; i < 4; ++i) {
+        const __m128i chars = _mm_loadu_si128((const __m128i *) (text + 16 * i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(chars, mask), prefix)) != 0xFFFF)
+            return false;
+        _mm_storel_epi64((__m128i *) (digits + 8 * i), _mm_shuffle_epi8(chars, select));
+    }
+    return true;
+}
+#endif
+
+static decode_function select_decoder(void) {
+#ifdef HEXSTRDUMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return decode_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return decode_ssse3;
+#endif
+    return decode_scalar;
+}
+
+static gather_function select_gatherer(void) {
+#ifdef HEXSTRDUMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        return gather_escapes_ssse3;
+#endif
+    return NULL;
+}
+
+typedef enum {
+    escaped_format,
+    c_string_format,
+    c_array_format,
+    xxd_format,
+    hex_format,
+    base64_format,
+    asm_format,
+    embed_format
+} format_kind;
+
+/* Every format except xxd is a sequence of lines of at most 'wrap' input bytes
+ * (a single line if 'wrap' is zero), each line being its encoded bytes between
+ * a fixed head and tail, so the output position of any input offset can be
+ * computed without encoding anything before it. */
+typedef struct {
+    const char *name;
+    format_kind kind;
+    size_t default_wrap;
+    const char *head;
+    const char *tail;
+    const char *empty;
+} format_t;
+
+static const format_t formats[] = {
+    { "escaped", escaped_format, 0, "", "\n", "\n" },
+    { "c-string", c_string_format, 16, "\"", "\"\n", "\"\"\n" },
+    { "c-array", c_array_format, 12, " ", "\n", "\n" },
+    { "xxd", xxd_format, 16, "", "", "" },
+    { "hex", hex_format, 0, "", "\n", "\n" },
+    { "base64", base64_format, 57, "", "\n", "\n" },
+    { "asm", asm_format, 0, "", "", "" },
+    { "embed", embed_format, 0, "", "", "" },
+};
+
+static const size_t max_xxd_wrap = 256;
+
+typedef struct {
+    const format_t *format;
+    size_t wrap;
+    size_t unit;
+    encode_function escape;
+    encode_function hex;
+    decode_function decode;
+    gather_function gather;
+    uint64_t offset;
+    uint64_t limit;
+    uint8_t *input;
+    char *output;
+    int output_fd;
+} context_t;
+
+typedef struct {
+    size_t threads;
+    size_t jobs;
+    bool decode;
+    bool compress;
+    bool bench;
+    size_t bench_size;
+    const char *output;
+    bool output_directory;
+    const char *suffix;
+    const char *header;
+    const char *name;
+    const char *cache;
+    uint64_t offset;
+    uint64_t limit;
+    const format_t *format;
+    size_t wrap;
+    bool wrap_given;
+    char **files;
+    int file_count;
+} options_t;
+
+static const char usage_message[] =
+    "usage: hexstrdump [OPTIONS] [FILE]...\n"
+    "Dump files as escaped hexadecimal strings ('-' is the standard input).\n"
+    "\n"
+    "  -o FILE        write the output to FILE instead of the standard output, or\n"
+    "                 if FILE is a directory, write one file per input into it\n"
+    "  --suffix S     write one file per input, named after it with S appended\n"
+    "  -j N           process N input files concurrently (0: all cores)\n"
+    "  -d, --decode   decode a dump in the given format back into binary\n"
+    "  --threads N    encode with N threads when writing to a file (0: all cores)\n"
+    "  --format F     output format: escaped (default), c-string, c-array, xxd,\n"
+    "                 hex, base64, asm (.incbin stub), or embed (C23 #embed)\n"
+    "  --wrap N       put N input bytes on each line (0: no wrapping), defaults\n"
+    "                 to 16 for c-string and xxd, 12 for c-array, 57 for base64\n"
+    "  --name NAME    symbol name for asm and embed (default: from the path)\n"
+    "  --compress     compress the input before encoding it\n"
+    "  --header FILE  write extern declarations for asm and embed to FILE, or\n"
+    "                 the decompression function for --compress\n"
+    "  --offset N     start at byte N of each input (decimal or 0x hexadecimal)\n"
+    "  --length N     encode at most N bytes of each input\n"
+    "  --cache DIR    reuse the outputs stored in DIR for unchanged inputs\n"
+    "  --bench        measure the throughput of every encoder on random data\n"
+    "  --size N       largest input of the benchmark, in MiB (default: 64)\n"
+    "  -h, --help     show this help\n"
+    "\n"
+    "The asm and embed formats reference the inputs by their absolute paths, so\n"
+    "the output is only usable where those paths are valid.\n";
+
+static char *append(char *output, const char *text) {
+    const size_t length = strlen(text);
+    memcpy(output, text, length);
+    return output + length;
+}
+
+/* Size of the encoded form of the given number of bytes within a line. */
+static uint64_t body_size(const format_t *format, uint64_t length) {
+    switch (format->kind) {
+    case escaped_format:
+    case c_string_format:
+        return length * 4;
+    case c_array_format:
+        return length * 6;
+    case hex_format:
+        return length * 2;
+    case base64_format:
+        return (length + 2) / 3 * 4;
+    case xxd_format:
+    case asm_format:
+    case embed_format:
+        break;
+    }
+    return 0;
+}
+
+static char *encode_body(const context_t *context, const uint8_t *input, size_t length, char *output) {
+    switch (context->format->kind) {
+    case escaped_format:
+    case c_string_format:
+        context->escape(input, length, output);
+        break;
+    case c_array_format:
+        for (size_t i = 0; i < length; ++i)
+            memcpy(output + 6 * i, c_array_table[input[i]], 6);
+        break;
+    case hex_format:
+        context->hex(input, length, output);
+        break;
+    case base64_format:
+        for (size_t i = 0; i + 3 <= length; i += 3) {
+            const uint32_t group = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+            memcpy(output + i / 3 * 4, base64_pairs[group >> 12], 2);
+            memcpy(output + i / 3 * 4 + 2, base64_pairs[group & 0xFFF], 2);
+        }
+        break;
+    case xxd_format:
+    case asm_format:
+    case embed_format:
+        break;
+    }
+    return output + body_size(context->format, length);
+}
+
+static unsigned xxd_offset_digits(uint64_t offset) {
+    unsigned digits = 8;
+    while (digits < 16 && (offset >> (4 * digits)) != 0)
+        ++digits;
+    return digits;
+}
+
+/* One line of 'xxd' output: the offset, the bytes in groups of two padded to
+ * the full width of a line, then the printable characters. */
+static char *encode_xxd_line(const context_t *context, const uint8_t *input, size_t length,
+                             uint64_t offset, char *output) {
+    for (unsigned digit = xxd_offset_digits(offset); digit > 0; --digit)
+        *output++ = hex_pairs[(offset >> (4 * (digit - 1))) & 0xF][1];
+    *output++ = ':';
+    *output++ = ' ';
+    for (size_t i = 0; i < context->wrap; ++i) {
+        if (i < length) {
+            memcpy(output, hex_pairs[input[i]], 2);
+        } else {
+            memcpy(output, "  ", 2);
+        }
+        output += 2;
+        if (i % 2 == 1 || i + 1 == context->wrap)
+            *output++ = ' ';
+    }
+    *output++ = ' ';
+    for (size_t i = 0; i < length; ++i)
+        *output++ = (input[i] >= 0x20 && input[i] < 0x7F) ? (char) input[i] : '.';
+    *output++ = '\n';
+    return output;
+}
+
+static uint64_t xxd_line_size(const context_t *context, uint64_t offset, size_t length) {
+    return xxd_offset_digits(offset) + 2 + context->wrap * 2 + (context->wrap + 1) / 2 + 1 + length + 1;
+}
+
+/* Number of output bytes preceding the encoding of the input byte at the given
+ * position, which must be a multiple of the unit of the format. */
+static uint64_t output_offset(const context_t *context, uint64_t position) {
+    const format_t *format = context->format;
+    if (format->kind == xxd_format) {
+        uint64_t size = 0;
+        uint64_t line = 0;
+        const uint64_t lines = position / context->wrap;
+        for (unsigned digits = 8; line < lines; ++digits) {
+            uint64_t end = lines;
+            if (digits < 16) {
+                const uint64_t limit = (uint64_t) 1 << (4 * digits);
+                end = (limit > context->offset) ? (limit - context->offset - 1) / context->wrap + 1 : 0;
+                end = (end > lines) ? lines : (end < line) ? line : end;
+            }
+            size += (end - line) * xxd_line_size(context, context->offset + line * context->wrap, context->wrap);
+            line = end;
+        }
+        return size;
+    }
+
+    const uint64_t frame = strlen(format->head) + strlen(format->tail);
+    const uint64_t lines = (context->wrap > 0) ? position / context->wrap : 0;
+    const uint64_t column = (context->wrap > 0) ? position % context->wrap : position;
+    return lines * frame + body_size(format, position) + ((column > 0) ? strlen(format->head) : 0);
+}
+
+/* Encodes whole units starting at the given input position. */
+static char *encode_range(const context_t *context, const uint8_t *input, size_t length,
+                          uint64_t position, char *output) {
+    const format_t *format = context->format;
+    if (format->kind == xxd_format) {
+        for (size_t i = 0; i < length; i += context->wrap)
+            output = encode_xxd_line(context, input + i, context->wrap, context->offset + position + i, output);
+        return output;
+    }
+
+    while (length > 0) {
+        const uint64_t column = (context->wrap > 0) ? position % context->wrap : position;
+        size_t current = length;
+        if (context->wrap > 0 && context->wrap - column < current)
+            current = context->wrap - column;
+        if (column == 0)
+            output = append(output, format->head);
+        output = encode_body(context, input, current, output);
+        if (context->wrap > 0 && column + current == context->wrap)
+            output = append(output, format->tail);
+        input += current;
+        length -= current;
+        position += current;
+    }
+    return output;
+}
+
+/* Encodes the trailing partial unit of an input of 'total' bytes and closes the
+ * last line. */
+static char *encode_finish(const context_t *context, const uint8_t *input, size_t length,
+                           uint64_t total, char *output) {
+    const format_t *format = context->format;
+    if (total == 0)
+        return append(output, format->empty);
+    if (format->kind == xxd_format)
+        return (length > 0) ? encode_xxd_line(context, input, length, context->offset + total - length, output)
+                            : output;
+
+    if (length > 0) {
+        const uint64_t position = total - length;
+        const uint64_t column = (context->wrap > 0) ? position % context->wrap : position;
+        if (column == 0)
+            output = append(output, format->head);
+        const uint32_t group = (input[0] << 16) | ((length > 1) ? input[1] << 8 : 0);
+        memcpy(output, base64_pairs[group >> 12], 2);
+        output[2] = (length > 1) ? base64_pairs[group & 0xFFF][0] : '=';
+        output[3] = '=';
+        output += 4;
+    }
+    if (context->wrap == 0 || total % context->wrap != 0)
+        output = append(output, format->tail);
+    return output;
+}
+
+static uint64_t output_size(const context_t *context, const uint8_t *input, uint64_t total) {
+    char trailer[4096];
+    const size_t remainder = total % context->unit;
+    const uint64_t bulk = total - remainder;
+    return output_offset(context, bulk) +
+           (encode_finish(context, input + bulk, remainder, total, trailer) - trailer);
+}
+
+/* Upper bound of the output of one block of input, used to size the output
+ * buffer. */
+static size_t block_output_size(const context_t *context) {
+    const format_t *format = context->format;
+    const size_t lines = ((context->wrap > 0) ? block_size / context->wrap : 0) + 2;
+    if (format->kind == xxd_format)
+        return lines * (16 + 2 + context->wrap * 4 + 2);
+    return body_size(format, block_size) + 4 + lines * (strlen(format->head) + strlen(format->tail));
+}
+
+static bool write_all(int fd, const void *data, size_t length) {
+    const char *bytes = (const char *) data;
+    while (length > 0) {
+        const ssize_t result = write(fd, bytes, length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return false;
+        bytes += result;
+        length -= result;
+    }
+    return true;
+}
+
+static bool encode_and_write(const context_t *context, const uint8_t *data, size_t length,
+                             uint64_t position) {
+    const size_t step = block_size - block_size % context->unit;
+    while (length > 0) {
+        const size_t current = (length < step) ? length : step;
+        const char *end = encode_range(context, data, current, position, context->output);
+        if (!write_all(context->output_fd, context->output, end - context->output))
+            return false;
+        data += current;
+        length -= current;
+        position += current;
+    }
+    return true;
+}
+
+static bool finish_and_write(const context_t *context, const uint8_t *data, size_t length,
+                             uint64_t total) {
+    const char *end = encode_finish(context, data, length, total, context->output);
+    return write_all(context->output_fd, context->output, end - context->output);
+}
+
+typedef struct {
+    void *mapping;
+    size_t mapped;
+    const uint8_t *data;
+    size_t length;
+} view_t;
+
+/* Maps the selected range of a regular file starting from the page holding
+ * its first byte, so only the pages of the range are ever touched. */
+static bool map_input(int fd, const struct stat *status, const context_t *context, view_t *view) {
+    const uint64_t size = status->st_size;
+    const uint64_t start = (context->offset < size) ? context->offset : size;
+    const uint64_t end = (context->limit < size - start) ? start + context->limit : size;
+    const uint64_t base = start - start % (uint64_t) sysconf(_SC_PAGESIZE);
+    view->mapping = NULL;
+    view->mapped = 0;
+    view->data = NULL;
+    view->length = end - start;
+    if (view->length == 0)
+        return true;
+
+    view->mapped = end - base;
+    view->mapping = mmap(NULL, view->mapped, PROT_READ, MAP_PRIVATE, fd, base);
+    if (view->mapping == MAP_FAILED) {
+        view->mapping = NULL;
+        return false;
+    }
+    view->data = (const uint8_t *) view->mapping + (start - base);
+    return true;
+}
+
+static void unmap_input(const view_t *view) {
+    if (view->mapping != NULL)
+        munmap(view->mapping, view->mapped);
+}
+
+/* Blocks are encoded in whole units of the format, the incomplete unit at the
+ * end of a read is carried over to the next one. The bytes before the selected
+ * range are skipped with a seek where the input allows it (block devices),
+ * and are read and dropped otherwise (pipes). */
+static bool process_stream(int fd, const char *path, const context_t *context) {
+    size_t carried = 0;
+    uint64_t position = 0;
+    uint64_t skipped = context->offset;
+    uint64_t remaining = context->limit;
+    if (skipped > 0 && skipped <= INT64_MAX && lseek(fd, (off_t) skipped, SEEK_CUR) >= 0)
+        skipped = 0;
+    for (;;) {
+        ssize_t length = 0;
+        if (remaining > 0)
+            length = read(fd, context->input + carried, block_size - carried);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length < 0) {
+            fprintf(stderr, "failed to read file: '%s'\n", path);
+            return false;
+        }
+
+        size_t fresh = length;
+        if (skipped > 0 && fresh > 0) {
+            const size_t dropped = (skipped < fresh) ? skipped : fresh;
+            memmove(context->input + carried, context->input + carried + dropped, fresh - dropped);
+            skipped -= dropped;
+            fresh -= dropped;
+            if (fresh == 0)
+                continue;
+        }
+        if (fresh > remaining)
+            fresh = remaining;
+        remaining -= fresh;
+
+        bool success;
+        const size_t available = carried + fresh;
+        if (fresh == 0) {
+            success = finish_and_write(context, context->input, carried, position + carried);
+        } else {
+            const size_t bulk = available - available % context->unit;
+            success = encode_and_write(context, context->input, bulk, position);
+            carried = available - bulk;
+            memmove(context->input, context->input + bulk, carried);
+            position += bulk;
+        }
+        if (!success) {
+            fputs("failed to write output\n", stderr);
+            return false;
+        }
+        if (fresh == 0)
+            return true;
+    }
+}
+
+/* Regular files are mapped and encoded straight from the page cache, anything
+ * else (pipes, terminals, or the standard input given as '-') is streamed in
+ * large blocks. */
+static bool process_single_file(const char *path, const context_t *context) {
+    const bool standard_input = (strcmp(path, "-") == 0);
+    const int fd = standard_input ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open file: '%s'\n", path);
+        return false;
+    }
+
+    struct stat status;
+    view_t view;
+    bool success;
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && map_input(fd, &status, context, &view)) {
+        const size_t bulk = view.length - view.length % context->unit;
+        if (view.mapping != NULL)
+            posix_madvise(view.mapping, view.mapped, POSIX_MADV_SEQUENTIAL);
+        success = encode_and_write(context, view.data, bulk, 0) &&
+                  finish_and_write(context, view.data + bulk, view.length - bulk, view.length);
+        unmap_input(&view);
+        if (!success)
+            fputs("failed to write output\n", stderr);
+    } else {
+        success = process_stream(fd, path, context);
+    }
+
+    if (!standard_input)
+        close(fd);
+    return success;
+}
+
+typedef struct {
+    const context_t *context;
+    const uint8_t *input;
+    size_t length;
+    uint64_t position;
+    char *output;
+} slice_t;
+
+static void *encode_slice(void *argument) {
+    const slice_t *slice = (const slice_t *) argument;
+    encode_range(slice->context, slice->input, slice->length, slice->position, slice->output);
+    return NULL;
+}
+
+/* The output size of every format is known from the input size alone, so the
+ * output file is sized up front and mapped, and every thread encodes its own
+ * slice of the input straight into its final position. Slices are multiples
+ * of 64 units to keep the vector kernels on their fast path. */
+static void encode_parallel(const context_t *context, const uint8_t *input, size_t length,
+                            char *output, size_t threads) {
+    slice_t *slices = (threads > 1) ? calloc(threads, sizeof(slice_t)) : NULL;
+    pthread_t *workers = (slices != NULL) ? calloc(threads, sizeof(pthread_t)) : NULL;
+    if (workers == NULL) {
+        free(slices);
+        encode_range(context, input, length, 0, output);
+        return;
+    }
+
+    const size_t granularity = 64 * context->unit;
+    const size_t slice_length = ((length + threads - 1) / threads + granularity - 1) / granularity * granularity;
+    size_t slice_count = 0;
+    size_t started = 0;
+    for (size_t offset = 0; offset < length; offset += slice_length) {
+        const size_t current = (length - offset < slice_length) ? length - offset : slice_length;
+        slice_t *slice = &slices[slice_count++];
+        *slice = (slice_t) { context, input + offset, current, offset,
+                             output + output_offset(context, offset) };
+        if (pthread_create(&workers[started], NULL, encode_slice, slice) == 0)
+            ++started;
+        else
+            encode_slice(slice);
+    }
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+    free(slices);
+    free(workers);
+}
+
+/* Encodes an input that is already in memory through the block buffer, for
+ * outputs that cannot be mapped. */
+static bool stream_output(int output_fd, const char *output_path, const context_t *context,
+                          const uint8_t *input, size_t length) {
+    context_t streaming = *context;
+    streaming.output_fd = output_fd;
+    const size_t bulk = length - length % context->unit;
+    if (!encode_and_write(&streaming, input, bulk, 0) ||
+        !finish_and_write(&streaming, input + bulk, length - bulk, length)) {
+        fprintf(stderr, "failed to write file: '%s'\n", output_path);
+        return false;
+    }
+    return true;
+}
+
+/* The blocks of the output are reserved before it is mapped, as a full
+ * filesystem would only show up as a SIGBUS while writing through the
+ * mapping. Where the space cannot be reserved, the output is streamed. */
+static bool map_output(int output_fd, const char *output_path, size_t length,
+                       const context_t *context, const uint8_t *input, size_t threads) {
+    const size_t size = output_size(context, input, length);
+    if (size == 0)
+        return true;
+    if (posix_fallocate(output_fd, 0, size) != 0) {
+        if (ftruncate(output_fd, 0) != 0) {
+            fprintf(stderr, "failed to write file: '%s'\n", output_path);
+            return false;
+        }
+        return stream_output(output_fd, output_path, context, input, length);
+    }
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, output_fd, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "failed to map file: '%s'\n", output_path);
+        return false;
+    }
+    const size_t bulk = length - length % context->unit;
+    encode_parallel(context, input, bulk, (char *) mapping, threads);
+    encode_finish(context, input + bulk, length - bulk, length,
+                  (char *) mapping + output_offset(context, bulk));
+    munmap(mapping, size);
+    return true;
+}
+
+/* Writes the dump of a single input into a file. Regular inputs are encoded
+ * from mapping to mapping, other inputs fall back to streaming into the
+ * file. Outputs that cannot be sized and mapped (devices, pipes) are always
+ * written by streaming. */
+static bool process_to_file(const char *path, const char *output_path,
+                            const context_t *context, size_t threads) {
+    const bool standard_input = (strcmp(path, "-") == 0);
+    const int fd = standard_input ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open file: '%s'\n", path);
+        return false;
+    }
+
+    struct stat status;
+    const bool regular = (fstat(fd, &status) == 0 && S_ISREG(status.st_mode));
+    struct stat output_status;
+    const bool exists = (stat(output_path, &output_status) == 0);
+    if (regular && exists &&
+        status.st_dev == output_status.st_dev && status.st_ino == output_status.st_ino) {
+        fprintf(stderr, "input and output are the same file: '%s'\n", path);
+        if (!standard_input)
+            close(fd);
+        return false;
+    }
+
+    const bool regular_output = !exists || S_ISREG(output_status.st_mode);
+    const int output_fd = regular_output ? open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644)
+                                         : open(output_path, O_WRONLY);
+    if (output_fd < 0) {
+        fprintf(stderr, "failed to open file: '%s'\n", output_path);
+        if (!standard_input)
+            close(fd);
+        return false;
+    }
+
+    view_t view;
+    bool success;
+    if (regular && map_input(fd, &status, context, &view)) {
+        if (view.mapping != NULL)
+            posix_madvise(view.mapping, view.mapped, POSIX_MADV_WILLNEED);
+        success = regular_output
+            ? map_output(output_fd, output_path, view.length, context, view.data, threads)
+            : stream_output(output_fd, output_path, context, view.data, view.length);
+        unmap_input(&view);
+    } else {
+        context_t streaming = *context;
+        streaming.output_fd = output_fd;
+        success = process_stream(fd, path, &streaming);
+    }
+
+    if (close(output_fd) != 0 && success) {
+        fprintf(stderr, "failed to write file: '%s'\n", output_path);
+        success = false;
+    }
+    if (!standard_input)
+        close(fd);
+    return success;
+}
+
+/* The symbol of an embedded file is its path with every character that is not
+ * valid in an identifier replaced by an underscore, like 'xxd -i' does. */
+static char *symbol_name(const char *path, const char *name) {
+    const char *source = (name != NULL) ? name : path;
+    char *symbol = malloc(strlen(source) + 2);
+    if (symbol == NULL)
+        return NULL;
+    char *target = symbol;
+    if (source[0] >= '0' && source[0] <= '9')
+        *target++ = '_';
+    for (; *source != '\0'; ++source) {
+        const char c = *source;
+        const bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                           (c >= '0' && c <= '9') || c == '_';
+        *target++ = valid ? c : '_';
+    }
+    *target = '\0';
+    return symbol;
+}
+
+/* Relative paths are prefixed with the working directory. */
+static char *absolute_path(const char *path) {
+    if (path[0] == '/')
+        return strdup(path);
+    char *directory = getcwd(NULL, 0);
+    if (directory == NULL)
+        return NULL;
+    char *absolute = malloc(strlen(directory) + strlen(path) + 2);
+    if (absolute != NULL) {
+        strcpy(absolute, directory);
+        strcat(absolute, "/");
+        strcat(absolute, path);
+    }
+    free(directory);
+    return absolute;
+}
+
+/* Prints a path as a string literal, escaping quotes and backslashes. */
+static int print_quoted(int fd, const char *path) {
+    int result = dprintf(fd, "\"");
+    for (; *path != '\0' && result >= 0; ++path) {
+        result = (*path == '"' || *path == '\\') ? dprintf(fd, "\\%c", *path)
+                                                   : dprintf(fd, "%c", *path);
+    }
+    return (result < 0) ? result : dprintf(fd, "\"");
+}
+
+/* Instead of encoding the contents, the asm and embed formats let the
+ * assembler or the compiler read the file itself, which is much faster to
+ * build than parsing a huge literal. The size is taken from the file as it is
+ * now, so the declarations can carry it as a constant. The file is named by
+ * its absolute path, as .incbin resolves relative paths from the working
+ * directory of the assembler, but #embed from the directory of the source. */
+static bool process_reference(const char *path, const options_t *options, int output_fd,
+                              int header_fd) {
+    struct stat status;
+    if (strcmp(path, "-") == 0) {
+        fputs("the standard input cannot be referenced\n", stderr);
+        return false;
+    }
+    if (stat(path, &status) != 0 || !S_ISREG(status.st_mode)) {
+        fprintf(stderr, "failed to open file: '%s'\n", path);
+        return false;
+    }
+
+    char *absolute = absolute_path(path);
+    char *symbol = symbol_name(path, options->name);
+    if (absolute == NULL || symbol == NULL) {
+        fputs("failed to allocate buffers\n", stderr);
+        free(absolute);
+        free(symbol);
+        return false;
+    }
+
+    const uint64_t file_size = status.st_size;
+    const unsigned long long start = (options->offset < file_size) ? options->offset : file_size;
+    const unsigned long long size = (options->limit < file_size - start) ? options->limit : file_size - start;
+    const bool slice = (options->offset > 0 || options->limit < UINT64_MAX);
+    if (size == 0 && options->format->kind == embed_format) {
+        fprintf(stderr, "an empty range cannot be embedded: '%s'\n", path);
+        free(absolute);
+        free(symbol);
+        return false;
+    }
+    int result;
+    if (options->format->kind == asm_format) {
+        result = dprintf(output_fd,
+                         "\t.section .rodata\n"
+                         "\t.global %s\n"
+                         "\t.type %s, @object\n"
+                         "\t.balign 16\n"
+                         "%s:\n"
+                         "\t.incbin ", symbol, symbol, symbol);
+        if (result >= 0)
+            result = print_quoted(output_fd, absolute);
+        if (result >= 0 && slice)
+            result = dprintf(output_fd, ", %llu, %llu", start, size);
+        if (result >= 0) {
+            result = dprintf(output_fd,
+                             "\n"
+                             "\t.size %s, %llu\n"
+                             "\t.global %s_size\n"
+                             "\t.type %s_size, @object\n"
+                             "\t.balign 8\n"
+                             "%s_size:\n"
+                             "\t.dc.a %llu\n"
+                             "\t.size %s_size, . - %s_size\n"
+                             "\t.section .note.GNU-stack,\"\",@progbits\n",
+                             symbol, size, symbol, symbol, symbol, size, symbol, symbol);
+        }
+    } else {
+        result = dprintf(output_fd, "const unsigned char %s[%llu] = {\n#embed ", symbol, size);
+        if (result >= 0)
+            result = print_quoted(output_fd, absolute);
+        if (result >= 0 && slice)
+            result = dprintf(output_fd, " limit(%llu)", size);
+        if (result >= 0)
+            result = dprintf(output_fd, "\n};\nconst size_t %s_size = %llu;\n", symbol, size);
+    }
+    if (result < 0) {
+        fputs("failed to write output\n", stderr);
+        free(absolute);
+        free(symbol);
+        return false;
+    }
+
+    /* C has no zero-length arrays, an empty .incbin is declared without a
+     * bound. */
+    if (header_fd >= 0 &&
+        ((size > 0) ? dprintf(header_fd, "extern const unsigned char %s[%llu];\n", symbol, size)
+                    : dprintf(header_fd, "extern const unsigned char %s[];\n", symbol)) < 0) {
+        fprintf(stderr, "failed to write file: '%s'\n", options->header);
+        free(absolute);
+        free(symbol);
+        return false;
+    }
+    if (header_fd >= 0 && dprintf(header_fd, "extern const size_t %s_size;\n", symbol) < 0) {
+        fprintf(stderr, "failed to write file: '%s'\n", options->header);
+        free(absolute);
+        free(symbol);
+        return false;
+    }
+    free(absolute);
+    free(symbol);
+    return true;
+}
+
+static int open_output(const char *path) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        fprintf(stderr, "failed to open file: '%s'\n", path);
+    return fd;
+}
+
+static bool process_references(const options_t *options) {
+    const int output_fd = (options->output != NULL) ? open_output(options->output) : STDOUT_FILENO;
+    if (output_fd < 0)
+        return false;
+    const int header_fd = (options->header != NULL) ? open_output(options->header) : -1;
+    bool success = (options->header == NULL || header_fd >= 0);
+
+    if (success && header_fd >= 0 &&
+        dprintf(header_fd, "#pragma once\n\n#include <stddef.h>\n\n") < 0) {
+        fprintf(stderr, "failed to write file: '%s'\n", options->header);
+        success = false;
+    }
+    if (success && options->format->kind == embed_format &&
+        dprintf(output_fd, "#include <stddef.h>\n\n") < 0) {
+        fputs("failed to write output\n", stderr);
+        success = false;
+    }
+    for (int i = 0; success && i < options->file_count; ++i)
+        success = process_reference(options->files[i], options, output_fd, header_fd);
+
+    if (header_fd >= 0 && close(header_fd) != 0 && success) {
+        fprintf(stderr, "failed to write file: '%s'\n", options->header);
+        success = false;
+    }
+    if (output_fd != STDOUT_FILENO && close(output_fd) != 0 && success) {
+        fprintf(stderr, "failed to write file: '%s'\n", options->output);
+        success = false;
+    }
+    return success;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Decoding works on whatever part of the text has been read so far: each
+ * function decodes the complete tokens at its start and returns the number of
+ * characters consumed, leaving the rest to be completed by the next read, or
+ * returns SIZE_MAX if the text is not valid in its format. */
+static size_t decode_escapes(const context_t *context, const char *text, size_t length, bool final,
+                             uint8_t *output, size_t *produced) {
+    const char *prefix = (context->format->kind == c_array_format) ? "0x" : "\\x";
+    char digits[128];
+    size_t i = 0;
+    size_t count = 0;
+    while (i < length) {
+        if (is_space(text[i]) || text[i] == '"' || text[i] == ',') {
+            ++i;
+            continue;
+        }
+
+        size_t gathered = 0;
+        while (context->gather != NULL && prefix[0] == '\\' && gathered < 64 && length - i >= 64 &&
+               context->gather(text + i, digits + 2 * gathered)) {
+            gathered += 16;
+            i += 64;
+        }
+        if (gathered > 0) {
+            if (!context->decode(digits, gathered, output + count))
+                return SIZE_MAX;
+            count += gathered;
+            continue;
+        }
+
+        if (length - i < 4)
+            break;
+        if (text[i] != prefix[0] || text[i + 1] != prefix[1] ||
+            !context->decode(text + i + 2, 1, output + count))
+            return SIZE_MAX;
+        ++count;
+        i += 4;
+    }
+    *produced = count;
+    return (final && i < length) ? SIZE_MAX : i;
+}
+
+static size_t decode_hex_text(const context_t *context, const char *text, size_t length, bool final,
+                              uint8_t *output, size_t *produced) {
+    size_t i = 0;
+    size_t count = 0;
+    while (i < length) {
+        if (is_space(text[i])) {
+            ++i;
+            continue;
+        }
+
+        const char *newline = memchr(text + i, '\n', length - i);
+        size_t run = (newline != NULL) ? (size_t) (newline - (text + i)) : length - i;
+        while (run > 0 && is_space(text[i + run - 1]))
+            --run;
+        if (newline == NULL && !final)
+            run &= ~(size_t) 1;
+        if (run == 0)
+            break;
+        if (run % 2 != 0 || !context->decode(text + i, run / 2, output + count))
+            return SIZE_MAX;
+        count += run / 2;
+        i += run;
+    }
+    *produced = count;
+    return (final && i < length) ? SIZE_MAX : i;
+}
+
+static size_t decode_base64_text(const char *text, size_t length, bool final, bool *finished,
+                                 uint8_t *output, size_t *produced) {
+    size_t i = 0;
+    size_t count = 0;
+    while (i < length) {
+        if (is_space(text[i])) {
+            ++i;
+            continue;
+        }
+        if (*finished || length - i < 4)
+            break;
+
+        const int a = base64_values[(uint8_t) text[i]];
+        const int b = base64_values[(uint8_t) text[i + 1]];
+        const int c = base64_values[(uint8_t) text[i + 2]];
+        const int d = base64_values[(uint8_t) text[i + 3]];
+        const uint32_t group = ((uint32_t) (a & 63) << 18) | ((b & 63) << 12) | ((c & 63) << 6) | (d & 63);
+        output[count] = group >> 16;
+        output[count + 1] = (group >> 8) & 0xFF;
+        output[count + 2] = group & 0xFF;
+        if ((a | b | c | d) >= 0) {
+            count += 3;
+        } else if ((a | b) >= 0 && text[i + 2] == '=' && text[i + 3] == '=') {
+            count += 1;
+            *finished = true;
+        } else if ((a | b | c) >= 0 && text[i + 3] == '=') {
+            count += 2;
+            *finished = true;
+        } else {
+            return SIZE_MAX;
+        }
+        i += 4;
+    }
+    *produced = count;
+    return (i < length && (final || *finished)) ? SIZE_MAX : i;
+}
+
+/* Lines of 'xxd' output are only decoded once complete: the offset is
+ * skipped, and the groups of digits are read up to the two spaces separating
+ * them from the printable characters. */
+static size_t decode_xxd_text(const context_t *context, const char *text, size_t length, bool final,
+                              uint8_t *output, size_t *produced) {
+    size_t i = 0;
+    size_t count = 0;
+    while (i < length) {
+        const char *newline = memchr(text + i, '\n', length - i);
+        if (newline == NULL && !final)
+            break;
+        const size_t end = (newline != NULL) ? (size_t) (newline - text) : length;
+
+        size_t j = i;
+        while (j < end && hex_values[(uint8_t) text[j]] >= 0)
+            ++j;
+        if (end > i && (j == i || j == end || text[j] != ':'))
+            return SIZE_MAX;
+        for (++j; j < end; ) {
+            if (text[j] == ' ') {
+                if (j + 1 < end && text[j + 1] == ' ')
+                    break;
+                ++j;
+                continue;
+            }
+            if (end - j < 2 || !context->decode(text + j, 1, output + count))
+                return SIZE_MAX;
+            ++count;
+            j += 2;
+        }
+        i = (newline != NULL) ? end + 1 : end;
+    }
+    *produced = count;
+    return i;
+}
+
+static size_t decode_text(const context_t *context, const char *text, size_t length, bool final,
+                          bool *finished, uint8_t *output, size_t *produced) {
+    *produced = 0;
+    switch (context->format->kind) {
+    case escaped_format:
+    case c_string_format:
+    case c_array_format:
+        return decode_escapes(context, text, length, final, output, produced);
+    case hex_format:
+        return decode_hex_text(context, text, length, final, output, produced);
+    case base64_format:
+        return decode_base64_text(text, length, final, finished, output, produced);
+    case xxd_format:
+        return decode_xxd_text(context, text, length, final, output, produced);
+    case asm_format:
+    case embed_format:
+        break;
+    }
+    return SIZE_MAX;
+}
+
+/* Dumps are decoded while streaming, with the incomplete token or line at the
+ * end of each read carried over to the next one. */
+static bool process_decode(const char *path, const context_t *context) {
+    const bool standard_input = (strcmp(path, "-") == 0);
+    const int fd = standard_input ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open file: '%s'\n", path);
+        return false;
+    }
+
+    const char *text = (const char *) context->input;
+    uint8_t *output = (uint8_t *) context->output;
+    size_t carried = 0;
+    bool finished = false;
+    bool success = true;
+    for (;;) {
+        const ssize_t length = read(fd, context->input + carried, block_size - carried);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length < 0) {
+            fprintf(stderr, "failed to read file: '%s'\n", path);
+            success = false;
+            break;
+        }
+
+        const size_t available = carried + length;
+        size_t produced;
+        const size_t consumed = decode_text(context, text, available, length == 0, &finished,
+                                            output, &produced);
+        if (consumed == SIZE_MAX || (consumed == 0 && available == block_size)) {
+            fprintf(stderr, "invalid %s input in file: '%s'\n", context->format->name, path);
+            success = false;
+            break;
+        }
+        if (!write_all(context->output_fd, output, produced)) {
+            fputs("failed to write output\n", stderr);
+            success = false;
+            break;
+        }
+        if (length == 0)
+            break;
+        carried = available - consumed;
+        memmove(context->input, context->input + consumed, carried);
+    }
+
+    if (!standard_input)
+        close(fd);
+    return success;
+}
+
+/* Compressed data is an 8-byte little-endian decompressed size followed by an
+ * LZ4 block: sequences of literals and back references of at least 4 bytes
+ * within the previous 64 KiB, which decompress with a few lines of C and no
+ * library. */
+static const char decoder_source[] =
+    "#include <stddef.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "/* Decompressed size of data produced by 'hexstrdump --compress'. */\n"
+    "static inline size_t hexstrdump_decompressed_size(const unsigned char *source, size_t size) {\n"
+    "    size_t result = 0;\n"
+    "    if (size < 8)\n"
+    "        return 0;\n"
+    "    for (int i = 7; i >= 0; --i)\n"
+    "        result = (result << 8) | source[i];\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline size_t hexstrdump_read_length(const unsigned char **source, const unsigned char *end,\n"
+    "                                            size_t length) {\n"
+    "    unsigned char extra = 255;\n"
+    "    while (length != (size_t) -1 && extra == 255) {\n"
+    "        if (*source == end)\n"
+    "            return (size_t) -1;\n"
+    "        extra = *(*source)++;\n"
+    "        length += extra;\n"
+    "    }\n"
+    "    return length;\n"
+    "}\n"
+    "\n"
+    "/* Decompresses data produced by 'hexstrdump --compress' into a buffer of at\n"
+    " * least hexstrdump_decompressed_size() bytes. Returns the number of bytes\n"
+    " * written, or 0 if the data is malformed or does not fit. */\n"
+    "static inline size_t hexstrdump_decompress(const unsigned char *source, size_t size,\n"
+    "                                           unsigned char *target, size_t capacity) {\n"
+    "    const unsigned char *end = source + size;\n"
+    "    const size_t expected = hexstrdump_decompressed_size(source, size);\n"
+    "    size_t written = 0;\n"
+    "    if (size < 9 || expected > capacity)\n"
+    "        return 0;\n"
+    "    for (source += 8; source < end; ) {\n"
+    "        const unsigned token = *source++;\n"
+    "        size_t literals = token >> 4;\n"
+    "        if (literals == 15)\n"
+    "            literals = hexstrdump_read_length(&source, end, literals);\n"
+    "        if (literals > (size_t) (end - source) || literals > expected - written)\n"
+    "            return 0;\n"
+    "        memcpy(target + written, source, literals);\n"
+    "        source += literals;\n"
+    "        written += literals;\n"
+    "        if (source == end)\n"
+    "            break;\n"
+    "\n"
+    "        if (end - source < 2)\n"
+    "            return 0;\n"
+    "        const size_t offset = source[0] | ((size_t) source[1] << 8);\n"
+    "        source += 2;\n"
+    "        size_t match = token & 15;\n"
+    "        if (match == 15)\n"
+    "            match = hexstrdump_read_length(&source, end, match);\n"
+    "        if (match == (size_t) -1 || (match += 4) > expected - written || offset == 0 || offset > written)\n"
+    "            return 0;\n"
+    "        for (size_t i = 0; i < match; ++i, ++written)\n"
+    "            target[written] = target[written - offset];\n"
+    "    }\n"
+    "    return (written == expected) ? written : 0;\n"
+    "}\n";
+
+static size_t compress_bound(size_t length) {
+    return 8 + length + length / 255 + 16;
+}
+
+static uint8_t *put_length(uint8_t *output, size_t length) {
+    for (; length >= 255; length -= 255)
+        *output++ = 255;
+    *output++ = (uint8_t) length;
+    return output;
+}
+
+static uint8_t *put_sequence(uint8_t *output, const uint8_t *literals, size_t literal_length,
+                             size_t offset, size_t match_length) {
+    const size_t match_code = (offset > 0) ? match_length - 4 : 0;
+    *output++ = (uint8_t) ((((literal_length < 15) ? literal_length : 15) << 4) |
+                           ((match_code < 15) ? match_code : 15));
+    if (literal_length >= 15)
+        output = put_length(output, literal_length - 15);
+    if (literal_length > 0)
+        memcpy(output, literals, literal_length);
+    output += literal_length;
+    if (offset == 0)
+        return output;
+    *output++ = offset & 0xFF;
+    *output++ = offset >> 8;
+    if (match_code >= 15)
+        output = put_length(output, match_code - 15);
+    return output;
+}
+
+static uint32_t read_quad(const uint8_t *data) {
+    uint32_t quad;
+    memcpy(&quad, data, sizeof(quad));
+    return quad;
+}
+
+/* Greedy LZ4 compression with a 64Ki-entry hash table of the last position of
+ * every 4-byte prefix. The search step grows while no match is found, so
+ * incompressible data passes through quickly. As the block format requires,
+ * the last match starts at least 12 bytes and ends at least 5 bytes before
+ * the end. */
+static size_t compress_block(const uint8_t *input, size_t length, uint8_t *output) {
+    size_t *table = calloc(1 << 16, sizeof(size_t));
+    if (table == NULL)
+        return 0;
+
+    uint8_t *target = output;
+    for (int i = 0; i < 8; ++i)
+        *target++ = (uint8_t) ((uint64_t) length >> (8 * i));
+
+    size_t anchor = 0;
+    size_t position = 0;
+    const size_t match_limit = (length > 12) ? length - 12 : 0;
+    while (position < match_limit) {
+        const uint32_t quad = read_quad(input + position);
+        const uint32_t hash = (quad * 2654435761u) >> 16;
+        const size_t candidate = table[hash];
+        table[hash] = position;
+        if (candidate >= position || position - candidate > 65535 || read_quad(input + candidate) != quad) {
+            position += 1 + ((position - anchor) >> 6);
+            continue;
+        }
+
+        size_t match_length = 4;
+        while (position + match_length < length - 5 &&
+               input[candidate + match_length] == input[position + match_length])
+            ++match_length;
+        target = put_sequence(target, input + anchor, position - anchor, position - candidate, match_length);
+        position += match_length;
+        anchor = position;
+    }
+    target = put_sequence(target, input + anchor, length - anchor, 0, 0);
+
+    free(table);
+    return target - output;
+}
+
+static bool read_all(int fd, const char *path, uint8_t **data, size_t *length) {
+    size_t capacity = block_size;
+    *data = malloc(capacity);
+    *length = 0;
+    for (;;) {
+        if (*data != NULL && *length == capacity) {
+            capacity *= 2;
+            uint8_t *grown = realloc(*data, capacity);
+            if (grown == NULL)
+                free(*data);
+            *data = grown;
+        }
+        if (*data == NULL) {
+            fputs("failed to allocate buffers\n", stderr);
+            return false;
+        }
+        const ssize_t result = read(fd, *data + *length, capacity - *length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0) {
+            fprintf(stderr, "failed to read file: '%s'\n", path);
+            free(*data);
+            *data = NULL;
+            return false;
+        }
+        if (result == 0)
+            return true;
+        *length += result;
+    }
+}
+
+/* Compression needs the whole input at once: regular files are mapped, other
+ * inputs are read into memory first. The compressed bytes are then encoded in
+ * the selected format like any other input. */
+static bool process_compressed(const char *path, const context_t *context) {
+    const bool standard_input = (strcmp(path, "-") == 0);
+    const int fd = standard_input ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open file: '%s'\n", path);
+        return false;
+    }
+
+    struct stat status;
+    view_t view = { NULL, 0, NULL, 0 };
+    uint8_t *buffer = NULL;
+    bool success = true;
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && map_input(fd, &status, context, &view)) {
+        if (view.mapping != NULL)
+            posix_madvise(view.mapping, view.mapped, POSIX_MADV_SEQUENTIAL);
+    } else if (read_all(fd, path, &buffer, &view.length)) {
+        const size_t start = (context->offset < view.length) ? context->offset : view.length;
+        view.data = buffer + start;
+        view.length -= start;
+        if (context->limit < view.length)
+            view.length = context->limit;
+    } else {
+        success = false;
+    }
+    if (!standard_input)
+        close(fd);
+
+    uint8_t *compressed = success ? malloc(compress_bound(view.length)) : NULL;
+    const size_t length = (compressed != NULL) ? compress_block(view.data, view.length, compressed) : 0;
+    if (success && length == 0) {
+        fputs("failed to allocate buffers\n", stderr);
+        success = false;
+    }
+    unmap_input(&view);
+    free(buffer);
+
+    if (success) {
+        context_t encoding = *context;
+        encoding.offset = 0;
+        const size_t bulk = length - length % context->unit;
+        success = encode_and_write(&encoding, compressed, bulk, 0) &&
+                  finish_and_write(&encoding, compressed + bulk, length - bulk, length);
+        if (!success)
+            fputs("failed to write output\n", stderr);
+    }
+    free(compressed);
+    return success;
+}
+
+/* Produces the output of one input without going through the cache. */
+static bool generate(const char *path, const options_t *options, const context_t *context) {
+    if (options->decode)
+        return process_decode(path, context);
+    if (options->compress)
+        return process_compressed(path, context);
+    return process_single_file(path, context);
+}
+
+/* Bumped whenever the output of any format changes, so stale entries are never
+ * reused. */
+static const char cache_version[] = "hexstrdump-cache 1";
+
+static const uint64_t hash_prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t hash_prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t hash_prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t hash_prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t hash_prime5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read_word(const uint8_t *data) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+static uint64_t hash_round(uint64_t accumulator, uint64_t input) {
+    return rotate_left(accumulator + input * hash_prime2, 31) * hash_prime1;
+}
+
+static uint64_t hash_merge(uint64_t hash, uint64_t accumulator) {
+    return (hash ^ hash_round(0, accumulator)) * hash_prime1 + hash_prime4;
+}
+
+/* XXH64: four independent multiply-rotate lanes over 32-byte stripes, so the
+ * hash runs at a large fraction of memory bandwidth. Only used to tell inputs
+ * apart, never for security. */
+static uint64_t hash_bytes(const uint8_t *data, size_t length, uint64_t seed) {
+    const uint8_t *end = data + length;
+    uint64_t hash;
+    if (length >= 32) {
+        uint64_t lanes[4] = { seed + hash_prime1 + hash_prime2, seed + hash_prime2, seed, seed - hash_prime1 };
+        for (; end - data >= 32; data += 32) {
+            for (int i = 0; i < 4; ++i)
+                lanes[i] = hash_round(lanes[i], read_word(data + 8 * i));
+        }
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) +
+               rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for (int i = 0; i < 4; ++i)
+            hash = hash_merge(hash, lanes[i]);
+    } else {
+        hash = seed + hash_prime5;
+    }
+
+    hash += length;
+    for (; end - data >= 8; data += 8)
+        hash = rotate_left(hash ^ hash_round(0, read_word(data)), 27) * hash_prime1 + hash_prime4;
+    if (end - data >= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        hash = rotate_left(hash ^ (word * hash_prime1), 23) * hash_prime2 + hash_prime3;
+        data += 4;
+    }
+    for (; data < end; ++data)
+        hash = rotate_left(hash ^ (*data * hash_prime5), 11) * hash_prime1;
+
+    hash ^= hash >> 33;
+    hash *= hash_prime2;
+    hash ^= hash >> 29;
+    hash *= hash_prime3;
+    return hash ^ (hash >> 32);
+}
+
+static bool copy_file(int input_fd, int output_fd, const context_t *context) {
+    for (;;) {
+        const ssize_t length = read(input_fd, context->input, block_size);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0)
+            return length == 0;
+        if (!write_all(output_fd, context->input, length))
+            return false;
+    }
+}
+
+/* Generates the output of an input into a fresh file of the cache directory,
+ * then renames it to its final name, so a concurrent or interrupted run never
+ * sees a partial entry. */
+static bool fill_cache(const char *path, const char *entry, const options_t *options,
+                       const context_t *context, const uint8_t *data, size_t length) {
+    char *temporary = malloc(strlen(entry) + 8);
+    if (temporary == NULL) {
+        fputs("failed to allocate buffers\n", stderr);
+        return false;
+    }
+    sprintf(temporary, "%s.XXXXXX", entry);
+    const int fd = mkstemp(temporary);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open file: '%s'\n", temporary);
+        free(temporary);
+        return false;
+    }
+
+    context_t generating = *context;
+    generating.output_fd = fd;
+    bool success;
+    if (options->decode || options->compress) {
+        success = generate(path, options, &generating);
+    } else if (length > 0) {
+        success = map_output(fd, temporary, length, &generating, data, options->threads);
+    } else {
+        success = finish_and_write(&generating, data, 0, 0);
+    }
+
+    if (close(fd) != 0 && success) {
+        fprintf(stderr, "failed to write file: '%s'\n", temporary);
+        success = false;
+    }
+    if (success && rename(temporary, entry) != 0) {
+        fprintf(stderr, "failed to write file: '%s'\n", entry);
+        success = false;
+    }
+    if (!success)
+        unlink(temporary);
+    free(temporary);
+    return success;
+}
+
+/* Entries are named after the hash of the input contents, seeded with the
+ * hash of everything that affects the output. Inputs that cannot be hashed
+ * up front (pipes, the standard input) bypass the cache. */
+static bool process_cached(const char *path, const options_t *options, const context_t *context) {
+    struct stat status;
+    const int fd = (strcmp(path, "-") == 0) ? -1 : open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+        if (fd >= 0)
+            close(fd);
+        return generate(path, options, context);
+    }
+
+    view_t view;
+    const bool mapped = map_input(fd, &status, context, &view);
+    close(fd);
+    if (!mapped) {
+        fprintf(stderr, "failed to read file: '%s'\n", path);
+        return false;
+    }
+    const size_t length = view.length;
+
+    char settings[128];
+    snprintf(settings, sizeof(settings), "%s %s %zu %d %d %llu", cache_version, context->format->name,
+             context->wrap, options->decode, options->compress, (unsigned long long) context->offset);
+    const uint64_t seed = hash_bytes((const uint8_t *) settings, strlen(settings), 0);
+    const uint64_t hash = hash_bytes(view.data, length, seed);
+
+    char *entry = malloc(strlen(options->cache) + 64);
+    bool success = (entry != NULL);
+    if (success) {
+        sprintf(entry, "%s/%016llx-%llx", options->cache, (unsigned long long) hash,
+                (unsigned long long) length);
+    } else {
+        fputs("failed to allocate buffers\n", stderr);
+    }
+
+    int cached = success ? open(entry, O_RDONLY) : -1;
+    if (success && cached < 0) {
+        success = fill_cache(path, entry, options, context, view.data, length);
+        cached = success ? open(entry, O_RDONLY) : -1;
+        if (success && cached < 0) {
+            fprintf(stderr, "failed to open file: '%s'\n", entry);
+            success = false;
+        }
+    }
+    if (cached >= 0) {
+        success = copy_file(cached, context->output_fd, context);
+        if (!success)
+            fputs("failed to write output\n", stderr);
+        close(cached);
+    }
+
+    unmap_input(&view);
+    free(entry);
+    return success;
+}
+
+static bool process_file(const char *path, const options_t *options, const context_t *context) {
+    if (options->cache != NULL)
+        return process_cached(path, options, context);
+    return generate(path, options, context);
+}
+
+/* Processes every input in turn into the output file, or the standard
+ * output. */
+static bool process_files(const options_t *options, context_t *context) {
+    if (options->output != NULL) {
+        context->output_fd = open_output(options->output);
+        if (context->output_fd < 0)
+            return false;
+    }
+
+    bool success = true;
+    for (int i = 0; i < options->file_count; ++i)
+        success &= process_file(options->files[i], options, context);
+
+    if (options->output != NULL && close(context->output_fd) != 0 && success) {
+        fprintf(stderr, "failed to write file: '%s'\n", options->output);
+        success = false;
+    }
+    return success;
+}
+
+static bool write_decoder(const char *path) {
+    const int fd = open_output(path);
+    if (fd < 0)
+        return false;
+    bool success = write_all(fd, decoder_source, strlen(decoder_source));
+    if (close(fd) != 0)
+        success = false;
+    if (!success)
+        fprintf(stderr, "failed to write file: '%s'\n", path);
+    return success;
+}
+
+/* Output of an input when writing one file per input: the input path with
+ * the suffix appended, or its last component placed in the output
+ * directory. */
+static char *target_path(const char *path, const options_t *options) {
+    const char *suffix = (options->suffix != NULL) ? options->suffix : "";
+    const char *name = path;
+    size_t directory_length = 0;
+    if (options->output_directory) {
+        const char *slash = strrchr(path, '/');
+        name = (slash != NULL) ? slash + 1 : path;
+        directory_length = strlen(options->output) + 1;
+    }
+
+    char *target = malloc(directory_length + strlen(name) + strlen(suffix) + 1);
+    if (target == NULL)
+        return NULL;
+    target[0] = '\0';
+    if (options->output_directory) {
+        strcpy(target, options->output);
+        strcat(target, "/");
+    }
+    strcat(target, name);
+    strcat(target, suffix);
+    return target;
+}
+
+static bool same_file(const char *path, const char *other) {
+    struct stat first;
+    struct stat second;
+    return stat(path, &first) == 0 && stat(other, &second) == 0 &&
+           first.st_dev == second.st_dev && first.st_ino == second.st_ino;
+}
+
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    const char *name;
+    const char *path;
+} target_t;
+
+static int compare_targets(const void *first, const void *second) {
+    const target_t *one = (const target_t *) first;
+    const target_t *other = (const target_t *) second;
+    if (one->device != other->device)
+        return (one->device < other->device) ? -1 : 1;
+    if (one->inode != other->inode)
+        return (one->inode < other->inode) ? -1 : 1;
+    return strcmp(one->name, other->name);
+}
+
+/* Two inputs with the same name written into one directory, or one input
+ * given twice under any spelling, would be encoded into the same file
+ * concurrently. The targets may not exist yet, so they are told apart by the
+ * directory they are in and their name. */
+static bool unique_targets(const options_t *options) {
+    target_t *targets = calloc(options->file_count, sizeof(target_t));
+    char **paths = calloc(options->file_count, sizeof(char *));
+    bool success = (targets != NULL && paths != NULL);
+    int count = 0;
+    for (int i = 0; success && i < options->file_count; ++i) {
+        paths[i] = target_path(options->files[i], options);
+        success = (paths[i] != NULL);
+        if (!success)
+            break;
+        char *slash = strrchr(paths[i], '/');
+        struct stat status;
+        bool found;
+        if (slash == NULL) {
+            found = (stat(".", &status) == 0);
+        } else {
+            const char kept = slash[1];
+            slash[1] = '\0';
+            found = (stat(paths[i], &status) == 0);
+            slash[1] = kept;
+        }
+        if (found) {
+            const char *name = (slash != NULL) ? slash + 1 : paths[i];
+            targets[count++] = (target_t) { status.st_dev, status.st_ino, name, paths[i] };
+        }
+    }
+    if (!success) {
+        fputs("failed to allocate buffers\n", stderr);
+    } else {
+        qsort(targets, count, sizeof(target_t), compare_targets);
+        for (int i = 1; success && i < count; ++i) {
+            if (compare_targets(&targets[i - 1], &targets[i]) == 0) {
+                fprintf(stderr, "more than one input would be written to: '%s'\n", targets[i].path);
+                success = false;
+            }
+        }
+    }
+    for (int i = 0; paths != NULL && i < options->file_count; ++i)
+        free(paths[i]);
+    free(paths);
+    free(targets);
+    return success;
+}
+
+/* Outputs for the standard output are held in temporary files until they are
+ * copied out, so workers may only run a window of inputs ahead of the one
+ * being copied. */
+typedef struct {
+    const options_t *options;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int next;
+    int emitted;
+    int window;
+    FILE **buffers;
+    signed char *results;
+} jobs_t;
+
+typedef struct {
+    jobs_t *jobs;
+    context_t context;
+} worker_t;
+
+static bool process_job(const char *path, const options_t *options, context_t *context,
+                        FILE **buffer) {
+    if (!options->output_directory && options->suffix == NULL) {
+        *buffer = tmpfile();
+        if (*buffer == NULL) {
+            fputs("failed to create a temporary file\n", stderr);
+            return false;
+        }
+        context->output_fd = fileno(*buffer);
+        return process_file(path, options, context);
+    }
+
+    if (strcmp(path, "-") == 0) {
+        fputs("the standard input cannot be written next to its input\n", stderr);
+        return false;
+    }
+    char *target = target_path(path, options);
+    if (target == NULL) {
+        fputs("failed to allocate buffers\n", stderr);
+        return false;
+    }
+
+    bool success;
+    if (same_file(path, target)) {
+        fprintf(stderr, "input and output are the same file: '%s'\n", path);
+        success = false;
+    } else if (options->cache == NULL && !options->decode && !options->compress) {
+        success = process_to_file(path, target, context, 1);
+    } else {
+        context->output_fd = open_output(target);
+        success = (context->output_fd >= 0) && process_file(path, options, context);
+        if (context->output_fd >= 0 && close(context->output_fd) != 0 && success) {
+            fprintf(stderr, "failed to write file: '%s'\n", target);
+            success = false;
+        }
+    }
+    free(target);
+    return success;
+}
+
+static void *run_jobs(void *argument) {
+    worker_t *worker = (worker_t *) argument;
+    jobs_t *jobs = worker->jobs;
+    for (;;) {
+        pthread_mutex_lock(&jobs->lock);
+        while (jobs->next < jobs->options->file_count && jobs->next - jobs->emitted >= jobs->window)
+            pthread_cond_wait(&jobs->finished, &jobs->lock);
+        const int index = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+        if (index >= jobs->options->file_count)
+            return NULL;
+
+        const bool success = process_job(jobs->options->files[index], jobs->options,
+                                         &worker->context, &jobs->buffers[index]);
+        pthread_mutex_lock(&jobs->lock);
+        jobs->results[index] = success ? 1 : -1;
+        pthread_cond_broadcast(&jobs->finished);
+        pthread_mutex_unlock(&jobs->lock);
+    }
+}
+
+/* Inputs are handed out to a pool of workers, each with buffers of its own.
+ * Outputs for the standard output are collected in temporary files, which are
+ * copied out in argument order as soon as every earlier input is done. */
+static bool process_jobs(const options_t *options, const context_t *context) {
+    if ((options->output_directory || options->suffix != NULL) && !unique_targets(options))
+        return false;
+    const size_t count = (options->jobs < (size_t) options->file_count) ? options->jobs
+                                                                        : (size_t) options->file_count;
+    const bool buffered = (!options->output_directory && options->suffix == NULL);
+    jobs_t jobs = { options, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0,
+                    buffered ? (int) (2 * count) : options->file_count, NULL, NULL };
+    jobs.buffers = calloc(options->file_count, sizeof(FILE *));
+    jobs.results = calloc(options->file_count, sizeof(signed char));
+    worker_t *workers = calloc(count, sizeof(worker_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    bool success = (jobs.buffers != NULL && jobs.results != NULL && workers != NULL && threads != NULL);
+
+    size_t allocated = 0;
+    for (; success && allocated < count; ++allocated) {
+        worker_t *worker = &workers[allocated];
+        worker->jobs = &jobs;
+        worker->context = *context;
+        worker->context.input = NULL;
+        worker->context.output = NULL;
+        if (posix_memalign((void **) &worker->context.input, 4096, block_size) != 0 ||
+            posix_memalign((void **) &worker->context.output, 4096, block_output_size(context)) != 0) {
+            free(worker->context.input);
+            success = false;
+            break;
+        }
+    }
+    if (!success) {
+        fputs("failed to allocate buffers\n", stderr);
+        for (size_t i = 0; i < allocated; ++i) {
+            free(workers[i].context.input);
+            free(workers[i].context.output);
+        }
+        free(jobs.buffers);
+        free(jobs.results);
+        free(workers);
+        free(threads);
+        return false;
+    }
+
+    size_t started = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (pthread_create(&threads[started], NULL, run_jobs, &workers[i]) == 0)
+            ++started;
+    }
+    if (started == 0 && count > 0) {
+        jobs.window = options->file_count;
+        run_jobs(&workers[0]);
+    }
+
+    for (int i = 0; i < options->file_count; ++i) {
+        pthread_mutex_lock(&jobs.lock);
+        while (jobs.results[i] == 0)
+            pthread_cond_wait(&jobs.finished, &jobs.lock);
+        pthread_mutex_unlock(&jobs.lock);
+
+        success &= (jobs.results[i] > 0);
+        FILE *buffer = jobs.buffers[i];
+        if (buffer != NULL) {
+            if (lseek(fileno(buffer), 0, SEEK_SET) != 0 ||
+                !copy_file(fileno(buffer), STDOUT_FILENO, context)) {
+                fputs("failed to write output\n", stderr);
+                success = false;
+            }
+            fclose(buffer);
+        }
+        pthread_mutex_lock(&jobs.lock);
+        jobs.emitted = i + 1;
+        pthread_cond_broadcast(&jobs.finished);
+        pthread_mutex_unlock(&jobs.lock);
+    }
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < count; ++i) {
+        free(workers[i].context.input);
+        free(workers[i].context.output);
+    }
+    free(jobs.buffers);
+    free(jobs.results);
+    free(workers);
+    free(threads);
+    return success;
+}
+
+/* The original encoder, printing every byte through stdio, kept as the
+ * reference of the benchmark. */
+static char *byte2hex(uint8_t byte, char *output) {
     static const char *digits = "0123456789ABCDEF";
     output[0] = '\\';
     output[1] = 'x';
@@ -12,38 +2040,383 @@ static char * byte2hex(uint8_t byte, char *output) {
     return output;
 }
 
-static void process_single_file(const char *path) {
-    FILE *handle = fopen(path, "rb");
-    if (!handle) {
-        fprintf(stderr, "failed to open file: '%s'\n", path);
+static void encode_byte2hex(const uint8_t *input, size_t length, char *output) {
+    FILE *stream = fmemopen(output, length * 4 + 1, "w");
+    if (stream == NULL)
         return;
+    char buffer[5];
+    for (size_t i = 0; i < length; ++i)
+        fputs(byte2hex(input[i], buffer), stream);
+    fclose(stream);
+}
+
+typedef struct {
+    const char *name;
+    encode_function encode;
+    size_t threads;
+} bench_path_t;
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Repeats the encoding until a quarter of a second has passed, so small
+ * inputs are measured over many runs. */
+static double measure(const bench_path_t *path, const context_t *context, const uint8_t *input,
+                      size_t length, char *output) {
+    context_t encoding = *context;
+    encoding.escape = path->encode;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t runs = 0;
+    double elapsed;
+    do {
+        if (path->threads > 1)
+            encode_parallel(&encoding, input, length, output, path->threads);
+        else
+            path->encode(input, length, output);
+        ++runs;
+        elapsed = elapsed_since(&start);
+    } while (elapsed < 0.25);
+    return (double) length * runs / elapsed / (1 << 20);
+}
+
+/* Encodes random inputs of several sizes with every available implementation
+ * of the default format, checking that all of them produce the output of the
+ * original encoder. */
+static bool process_bench(size_t megabytes, size_t threads, const context_t *context) {
+    const size_t sizes[] = { 4 << 10, 1 << 20, megabytes << 20 };
+    const size_t largest = sizes[2];
+    uint8_t *input = malloc(largest);
+    char *reference = malloc(largest * 4 + 1);
+    char *output = malloc(largest * 4 + 1);
+    if (input == NULL || reference == NULL || output == NULL) {
+        fputs("failed to allocate buffers\n", stderr);
+        free(input);
+        free(reference);
+        free(output);
+        return false;
     }
 
-    fseek(handle, 0, SEEK_END);
-    const size_t length = ftell(handle);
-    fseek(handle, 0, SEEK_SET);
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < largest; ++i) {
+        state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+        input[i] = (uint8_t) (state >> 32);
+    }
 
-    static const size_t chunk_size = 8;
-    const size_t chunks = length / chunk_size;
+    bench_path_t paths[5];
+    size_t count = 0;
+    paths[count++] = (bench_path_t) { "byte2hex", encode_byte2hex, 1 };
+    paths[count++] = (bench_path_t) { "table", encode_scalar, 1 };
+#ifdef HEXSTRDUMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        paths[count++] = (bench_path_t) { "ssse3", encode_ssse3, 1 };
+    if (__builtin_cpu_supports("avx2"))
+        paths[count++] = (bench_path_t) { "avx2", encode_avx2, 1 };
+#endif
+    if (threads > 1) {
+        paths[count] = (bench_path_t) { "threaded", paths[count - 1].encode, threads };
+        ++count;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        const size_t length = sizes[i];
+        encode_byte2hex(input, length, reference);
+        if (length >= (1 << 20)) {
+            printf("size: %zu MiB, threads: %zu\n", length >> 20, threads);
+        } else {
+            printf("size: %zu KiB, threads: %zu\n", length >> 10, threads);
+        }
 
-    char buffer[5] = { '\0', '\0', '\0', '\0', '\0' };
-    for (size_t i = 0; i <= chunks; ++i) {
-        const size_t current_length = (i == chunks) ? length % chunk_size : chunk_size;
-        uint8_t current[8];
-        fread(current, 1, current_length, handle);
-        for (size_t j = 0; j < current_length; ++j) {
-            fputs(byte2hex(current[j], buffer), stdout);
+        for (size_t j = 0; j < count; ++j) {
+            memset(output, 0, length * 4);
+            const double speed = measure(&paths[j], context, input, length, output);
+            printf("%s: %u MB/s", paths[j].name, (unsigned) speed);
+            if (memcmp(output, reference, length * 4) != 0) {
+                printf(", MISMATCH");
+                success = false;
+            }
+            putchar('\n');
         }
+        fflush(stdout);
     }
 
-    fputc('\n', stdout);
-    fclose(handle);
+    free(input);
+    free(reference);
+    free(output);
+    return success;
 }
 
-int main(int argc, char **argv) {
-    --argc, ++argv;
+static bool parse_count(const char *text, size_t *count) {
+    char *end;
+    errno = 0;
+    const unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-')
+        return false;
+    *count = value;
+    return true;
+}
+
+static bool parse_position(const char *text, uint64_t *position) {
+    const bool hexadecimal = (text[0] == '0' && (text[1] == 'x' || text[1] == 'X'));
+    char *end;
+    errno = 0;
+    const unsigned long long value = strtoull(text, &end, hexadecimal ? 16 : 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-')
+        return false;
+    *position = value;
+    return true;
+}
+
+static const format_t *find_format(const char *name) {
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        if (strcmp(formats[i].name, name) == 0)
+            return &formats[i];
+    }
+    return NULL;
+}
+
+/* The output file is truncated before the inputs are read, so it must not be
+ * one of them. */
+static bool overwrites_input(const options_t *options) {
+    struct stat output_status;
+    if (stat(options->output, &output_status) != 0)
+        return false;
+    for (int i = 0; i < options->file_count; ++i) {
+        struct stat status;
+        if (stat(options->files[i], &status) == 0 && status.st_dev == output_status.st_dev &&
+            status.st_ino == output_status.st_ino) {
+            fprintf(stderr, "input and output are the same file: '%s'\n", options->files[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_arguments(int argc, char **argv, options_t *options) {
+    options->threads = 1;
+    options->jobs = 1;
+    options->output_directory = false;
+    options->suffix = NULL;
+    options->decode = false;
+    options->compress = false;
+    options->bench = false;
+    options->bench_size = 64;
+    options->output = NULL;
+    options->header = NULL;
+    options->name = NULL;
+    options->cache = NULL;
+    options->offset = 0;
+    options->limit = UINT64_MAX;
+    options->format = &formats[0];
+    options->wrap = 0;
+    options->wrap_given = false;
+    options->files = argv;
+    options->file_count = 0;
+
+    bool only_files = false;
     for (int i = 0; i < argc; ++i) {
-        process_single_file(argv[i]);
+        const char *argument = argv[i];
+        if (only_files || argument[0] != '-' || strcmp(argument, "-") == 0) {
+            options->files[options->file_count++] = argv[i];
+        } else if (strcmp(argument, "--") == 0) {
+            only_files = true;
+        } else if (strcmp(argument, "-h") == 0 || strcmp(argument, "--help") == 0) {
+            fputs(usage_message, stdout);
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(argument, "-d") == 0 || strcmp(argument, "--decode") == 0) {
+            options->decode = true;
+        } else if (strcmp(argument, "--bench") == 0) {
+            options->bench = true;
+        } else if (strcmp(argument, "--size") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &options->bench_size) || options->bench_size == 0 ||
+                options->bench_size > 4096) {
+                fprintf(stderr, "invalid size: '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argument, "--compress") == 0) {
+            options->compress = true;
+        } else if (strcmp(argument, "-o") == 0 && i + 1 < argc) {
+            options->output = argv[++i];
+        } else if (strcmp(argument, "--threads") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &options->threads)) {
+                fprintf(stderr, "invalid thread count: '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argument, "-j") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &options->jobs)) {
+                fprintf(stderr, "invalid job count: '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argument, "--suffix") == 0 && i + 1 < argc) {
+            options->suffix = argv[++i];
+        } else if (strcmp(argument, "--format") == 0 && i + 1 < argc) {
+            options->format = find_format(argv[++i]);
+            if (options->format == NULL) {
+                fprintf(stderr, "invalid format: '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argument, "--name") == 0 && i + 1 < argc) {
+            options->name = argv[++i];
+        } else if (strcmp(argument, "--offset") == 0 && i + 1 < argc) {
+            if (!parse_position(argv[++i], &options->offset)) {
+                fprintf(stderr, "invalid offset: '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argument, "--length") == 0 && i + 1 < argc) {
+            if (!parse_position(argv[++i], &options->limit)) {
+                fprintf(stderr, "invalid length: '%s'\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argument, "--cache") == 0 && i + 1 < argc) {
+            options->cache = argv[++i];
+        } else if (strcmp(argument, "--header") == 0 && i + 1 < argc) {
+            options->header = argv[++i];
+        } else if (strcmp(argument, "--wrap") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &options->wrap)) {
+                fprintf(stderr, "invalid line width: '%s'\n", argv[i]);
+                return false;
+            }
+            options->wrap_given = true;
+        } else {
+            fprintf(stderr, "invalid argument: '%s'\n", argument);
+            fputs(usage_message, stderr);
+            return false;
+        }
     }
-    return 0;
+
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (options->threads == 0)
+        options->threads = (online > 0) ? (size_t) online : 1;
+    if (options->jobs == 0)
+        options->jobs = (online > 0) ? (size_t) online : 1;
+    struct stat status;
+    options->output_directory = (options->output != NULL && stat(options->output, &status) == 0 &&
+                                 S_ISDIR(status.st_mode));
+    if (!options->wrap_given)
+        options->wrap = options->format->default_wrap;
+    if (options->format->kind == xxd_format && (options->wrap == 0 || options->wrap > max_xxd_wrap)) {
+        fprintf(stderr, "xxd lines must hold 1 to %zu bytes\n", max_xxd_wrap);
+        return false;
+    }
+    if (options->format->kind == base64_format && options->wrap % 3 != 0) {
+        fputs("base64 lines must hold a multiple of 3 bytes\n", stderr);
+        return false;
+    }
+    const bool reference = (options->format->kind == asm_format ||
+                            options->format->kind == embed_format);
+    if (reference && options->decode) {
+        fputs("the asm and embed formats cannot be decoded\n", stderr);
+        return false;
+    }
+    const bool slice = (options->offset > 0 || options->limit < UINT64_MAX);
+    if (slice && options->decode) {
+        fputs("--offset and --length only apply to encoding\n", stderr);
+        return false;
+    }
+    if (options->offset > 0 && options->format->kind == embed_format) {
+        fputs("#embed cannot start at an offset, use the asm format instead\n", stderr);
+        return false;
+    }
+    if (reference && options->cache != NULL) {
+        fputs("--cache does not apply to the asm and embed formats\n", stderr);
+        return false;
+    }
+    if (options->compress && (reference || options->decode)) {
+        fputs("--compress only applies to encoding with the other formats\n", stderr);
+        return false;
+    }
+    if (!reference && options->name != NULL) {
+        fputs("--name only applies to the asm and embed formats\n", stderr);
+        return false;
+    }
+    if (!reference && !options->compress && options->header != NULL) {
+        fputs("--header only applies to the asm and embed formats and --compress\n", stderr);
+        return false;
+    }
+    if (options->name != NULL && options->file_count != 1) {
+        fputs("--name requires exactly one input file\n", stderr);
+        return false;
+    }
+    if (reference && (options->jobs > 1 || options->suffix != NULL || options->output_directory)) {
+        fputs("-j, --suffix and output directories do not apply to the asm and embed formats\n", stderr);
+        return false;
+    }
+    if (options->suffix != NULL && options->output != NULL && !options->output_directory) {
+        fputs("--suffix cannot be combined with an output file\n", stderr);
+        return false;
+    }
+    if (!reference && options->output != NULL && !options->output_directory && options->file_count != 1) {
+        fputs("-o requires exactly one input file\n", stderr);
+        return false;
+    }
+    return options->output == NULL || !overwrites_input(options);
+}
+
+int main(int argc, char **argv) {
+    options_t options;
+    if (!parse_arguments(argc - 1, argv + 1, &options))
+        return EXIT_FAILURE;
+    if (options.format->kind == asm_format || options.format->kind == embed_format)
+        return process_references(&options) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    context_t context;
+    context.format = options.format;
+    context.wrap = options.wrap;
+    switch (options.format->kind) {
+    case xxd_format:
+        context.unit = options.wrap;
+        break;
+    case base64_format:
+        context.unit = 3;
+        break;
+    default:
+        context.unit = 1;
+        break;
+    }
+    context.escape = select_encoder();
+    context.hex = select_hex_encoder();
+    context.decode = select_decoder();
+    context.gather = select_gatherer();
+    context.offset = options.offset;
+    context.limit = options.limit;
+    context.output_fd = STDOUT_FILENO;
+    context.input = NULL;
+    context.output = NULL;
+    if (posix_memalign((void **) &context.input, 4096, block_size) != 0 ||
+        posix_memalign((void **) &context.output, 4096, block_output_size(&context)) != 0) {
+        fputs("failed to allocate buffers\n", stderr);
+        free(context.input);
+        return EXIT_FAILURE;
+    }
+
+    build_tables();
+    bool success = true;
+    if (options.bench) {
+        success = process_bench(options.bench_size, options.threads, &context);
+        free(context.input);
+        free(context.output);
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (options.cache != NULL && mkdir(options.cache, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create directory: '%s'\n", options.cache);
+        success = false;
+    } else if (options.header != NULL && !write_decoder(options.header)) {
+        success = false;
+    } else if ((options.jobs > 1 && options.output == NULL) || options.suffix != NULL ||
+               options.output_directory) {
+        success = process_jobs(&options, &context);
+    } else if (options.output != NULL && options.cache == NULL && !options.decode && !options.compress) {
+        success = process_to_file(options.files[0], options.output, &context, options.threads);
+    } else {
+        success = process_files(&options, &context);
+    }
+
+    free(context.input);
+    free(context.output);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -1,55 +1,1627 @@
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
-static char add(char lhs, char rhs) {
-    return ((lhs - 'A' + rhs - 'A') % 26) + 'A';
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VIGENERE_X86
+#include <immintrin.h>
+#endif
+
+static const size_t block_size = 1 << 20;
+static const size_t chunk_size = 8 << 20;
+static const size_t max_round_size = 64 << 20;
+
+enum cipher_mode {
+    encrypt_mode,
+    decrypt_mode
+};
+
+enum cipher_type {
+    vigenere_type,
+    beaufort_type,
+    variant_beaufort_type,
+    autokey_type
+};
+
+// Cipher policies map the alphabet index of a letter and of the current key
+// letter to the alphabet index of the result. The classic ciphers, and the
+// variant Beaufort cipher which is its inverse, add a per-key-letter shift,
+// so they can also go through the vector kernels.
+struct vigenere_policy {
+    static const bool additive = true;
+
+    template <cipher_mode Mode>
+    static int apply(int letter, int key) {
+        return (Mode == encrypt_mode) ? (letter + key) % 26 : (letter + 26 - key) % 26;
+    }
+};
+
+struct beaufort_policy {
+    static const bool additive = false;
+
+    template <cipher_mode Mode>
+    static int apply(int letter, int key) {
+        return (key + 26 - letter) % 26;
+    }
+};
+
+struct variant_beaufort_policy {
+    static const bool additive = true;
+
+    template <cipher_mode Mode>
+    static int apply(int letter, int key) {
+        return vigenere_policy::apply<Mode == encrypt_mode ? decrypt_mode : encrypt_mode>(letter, key);
+    }
+};
+
+// The key is kept as a list of shift values (already negated for
+// decryption) and, for letters, as one 256-entry translation table per key
+// position. Shifts and tables are repeated over 'period' positions, and the
+// shifts have an extra tail, so that vector kernels can load a window of
+// shifts starting at any position without wrapping around. In byte mode the
+// shifts are the raw key bytes, and every byte of the input advances the key.
+// The autokey cipher extends the key with the text itself, so it keeps the
+// last key-length letters in 'stream' instead, and can only run serially.
+struct key_schedule {
+    cipher_type cipher;
+    cipher_mode mode;
+    bool bytes;
+    bool additive;
+    unsigned char case_bits;
+    std::string text;
+    size_t period;
+    std::vector<unsigned char> shifts;
+    std::vector<unsigned char> tables;
+    mutable std::vector<unsigned char> stream;
+};
+
+static const size_t schedule_tail = 32;
+
+static inline bool is_letter(unsigned char c) {
+    return static_cast<unsigned char>((c & 0xDF) - 'A') < 26;
 }
 
-static char subtract(char lhs, char rhs) {
-    return ((lhs - 'A' - rhs + 'A' + 52) % 26) + 'A';
+// Builds the shifts and the translation tables from the 26x26 tableau of the
+// cipher, mapping letters to the uppercase result (or to the case of the
+// input, if 'case_bits' is set), and every other byte to itself.
+template <typename Cipher, cipher_mode Mode>
+static void build_tables(key_schedule& schedule) {
+    unsigned char tableau[26][26];
+    for (int key = 0; key < 26; ++key) {
+        for (int letter = 0; letter < 26; ++letter)
+            tableau[key][letter] = Cipher::template apply<Mode>(letter, key);
+    }
+
+    const size_t key_length = schedule.text.size();
+    schedule.additive = Cipher::additive;
+    for (size_t i = 0; i < schedule.shifts.size(); ++i)
+        schedule.shifts[i] = tableau[schedule.text[i % key_length] - 'A'][0];
+
+    schedule.tables.resize(schedule.period * 256);
+    for (size_t position = 0; position < schedule.period; ++position) {
+        const unsigned char *row = tableau[schedule.text[position % key_length] - 'A'];
+        unsigned char *table = &schedule.tables[position * 256];
+        for (int c = 0; c < 256; ++c)
+            table[c] = is_letter(c) ? ('A' + row[(c & 0xDF) - 'A']) | (c & schedule.case_bits) : c;
+    }
 }
 
-int main(int argc, char **argv) {
-    --argc, ++argv;
-    if (argc != 2) {
-        std::cerr << "usage: vigenere <encrypt|decrypt> <key>" << std::endl;
-        return 1;
+template <typename Cipher>
+static void build_tables(key_schedule& schedule) {
+    if (schedule.mode == encrypt_mode)
+        build_tables<Cipher, encrypt_mode>(schedule);
+    else
+        build_tables<Cipher, decrypt_mode>(schedule);
+}
+
+static key_schedule make_schedule(const char *key, cipher_type cipher, cipher_mode mode,
+                                  bool bytes, bool preserve_case) {
+    key_schedule result;
+    result.cipher = cipher;
+    result.mode = mode;
+    result.bytes = bytes;
+    result.additive = bytes;
+    result.case_bits = preserve_case ? 0x20 : 0x00;
+    result.text = key;
+
+    const size_t key_length = result.text.size();
+    result.period = key_length * ((schedule_tail + key_length - 1) / key_length);
+    result.shifts.resize(result.period + schedule_tail);
+
+    if (bytes) {
+        for (size_t i = 0; i < result.shifts.size(); ++i) {
+            const unsigned char shift = result.text[i % key_length];
+            result.shifts[i] = (mode == encrypt_mode) ? shift : -shift;
+        }
+        return result;
     }
 
-    char *key = argv[1];
-    const size_t key_length = strlen(key);
     for (size_t i = 0; i < key_length; ++i)
-        key[i] = toupper(key[i]);
+        result.text[i] = toupper(result.text[i]);
 
-    enum {
-        encrypt_mode,
-        decrypt_mode
-    } mode;
+    switch (cipher) {
+        case beaufort_type:
+            build_tables<beaufort_policy>(result);
+            break;
+        case variant_beaufort_type:
+            build_tables<variant_beaufort_policy>(result);
+            break;
+        case autokey_type:
+            for (size_t i = 0; i < key_length; ++i)
+                result.stream.push_back(result.text[i] - 'A');
+            break;
+        default:
+            build_tables<vigenere_policy>(result);
+            break;
+    }
+    return result;
+}
 
-    if (strcmp(argv[0], "encrypt") == 0) {
-        mode = encrypt_mode;
-    } else if (strcmp(argv[0], "decrypt") == 0) {
-        mode = decrypt_mode;
-    } else {
-        std::cerr << "mode must be either 'encrypt' or 'decrypt'" << std::endl;
-        return 1;
+static bool is_valid_key(const char *key) {
+    if (*key == '\0')
+        return false;
+    for (; *key != '\0'; ++key) {
+        if (!isalpha(static_cast<unsigned char>(*key)))
+            return false;
+    }
+    return true;
+}
+
+static size_t advance(const key_schedule& key, size_t position, size_t count) {
+    position += count;
+    return (position >= key.period) ? position - key.period : position;
+}
+
+static size_t transform_table(char *data, size_t length,
+                              const key_schedule& key, size_t position) {
+    const unsigned char *tables = key.tables.data();
+    const size_t period = key.period;
+    for (size_t i = 0; i < length; ++i) {
+        const unsigned char current = data[i];
+        data[i] = tables[position * 256 + current];
+        position += is_letter(current);
+        position = (position == period) ? 0 : position;
+    }
+    return position;
+}
+
+#ifdef VIGENERE_X86
+// Encrypts 16 bytes, where 'window' holds the shifts for the next 16 letters
+// of the text. Letters are found by folding to uppercase and checking the
+// range, then an exclusive prefix sum of the letter mask tells each byte how
+// many letters precede it, which selects its shift from the window. The
+// result is reduced modulo 26 by a compare-and-subtract, and non-letters are
+// blended through unchanged.
+__attribute__((target("ssse3")))
+static inline __m128i encrypt_16(__m128i input, __m128i window,
+                                 __m128i case_bits, int& count) {
+    const __m128i upper = _mm_and_si128(input, _mm_set1_epi8(char(0xDF)));
+    const __m128i index = _mm_sub_epi8(upper, _mm_set1_epi8('A'));
+    const __m128i letters = _mm_cmpeq_epi8(
+        _mm_min_epu8(index, _mm_set1_epi8(25)), index);
+
+    const __m128i ones = _mm_and_si128(letters, _mm_set1_epi8(1));
+    __m128i prefix = _mm_add_epi8(ones, _mm_slli_si128(ones, 1));
+    prefix = _mm_add_epi8(prefix, _mm_slli_si128(prefix, 2));
+    prefix = _mm_add_epi8(prefix, _mm_slli_si128(prefix, 4));
+    prefix = _mm_add_epi8(prefix, _mm_slli_si128(prefix, 8));
+    prefix = _mm_sub_epi8(prefix, ones);
+
+    __m128i sum = _mm_add_epi8(index, _mm_shuffle_epi8(window, prefix));
+    const __m128i wrap = _mm_cmpeq_epi8(
+        _mm_max_epu8(sum, _mm_set1_epi8(26)), sum);
+    sum = _mm_sub_epi8(sum, _mm_and_si128(wrap, _mm_set1_epi8(26)));
+    sum = _mm_add_epi8(sum, _mm_set1_epi8('A'));
+    sum = _mm_or_si128(sum, _mm_and_si128(input, case_bits));
+
+    count = __builtin_popcount(_mm_movemask_epi8(letters));
+    return _mm_or_si128(_mm_and_si128(letters, sum),
+                        _mm_andnot_si128(letters, input));
+}
+
+__attribute__((target("ssse3")))
+static size_t transform_ssse3(char *data, size_t length,
+                              const key_schedule& key, size_t position) {
+    const unsigned char *shifts = &key.shifts[0];
+    const __m128i case_bits = _mm_set1_epi8(key.case_bits);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i *chunk = reinterpret_cast<__m128i *>(data + i);
+        const __m128i window = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(shifts + position));
+        int count;
+        const __m128i input = _mm_loadu_si128(chunk);
+        _mm_storeu_si128(chunk, encrypt_16(input, window, case_bits, count));
+        position = advance(key, position, count);
+    }
+    return transform_table(data + i, length - i, key, position);
+}
+
+// The AVX2 variant does the same as the SSSE3 one on both 128-bit lanes at
+// once. Byte shuffles and shifts do not cross lanes, so the upper lane gets
+// its own window of shifts, starting after the letters of the lower lane.
+__attribute__((target("avx2")))
+static size_t transform_avx2(char *data, size_t length,
+                             const key_schedule& key, size_t position) {
+    const unsigned char *shifts = &key.shifts[0];
+    const __m256i case_mask = _mm256_set1_epi8(char(0xDF));
+    const __m256i first = _mm256_set1_epi8('A');
+    const __m256i last = _mm256_set1_epi8(25);
+    const __m256i modulus = _mm256_set1_epi8(26);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i case_bits = _mm256_set1_epi8(key.case_bits);
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i *chunk = reinterpret_cast<__m256i *>(data + i);
+        const __m256i input = _mm256_loadu_si256(chunk);
+        const __m256i upper = _mm256_and_si256(input, case_mask);
+        const __m256i index = _mm256_sub_epi8(upper, first);
+        const __m256i letters = _mm256_cmpeq_epi8(
+            _mm256_min_epu8(index, last), index);
+
+        const unsigned mask = _mm256_movemask_epi8(letters);
+        const size_t high = advance(key, position, __builtin_popcount(mask & 0xFFFF));
+        const __m256i window = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(shifts + position))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(shifts + high)), 1);
+
+        const __m256i ones = _mm256_and_si256(letters, one);
+        __m256i prefix = _mm256_add_epi8(ones, _mm256_slli_si256(ones, 1));
+        prefix = _mm256_add_epi8(prefix, _mm256_slli_si256(prefix, 2));
+        prefix = _mm256_add_epi8(prefix, _mm256_slli_si256(prefix, 4));
+        prefix = _mm256_add_epi8(prefix, _mm256_slli_si256(prefix, 8));
+        prefix = _mm256_sub_epi8(prefix, ones);
+
+        __m256i sum = _mm256_add_epi8(index, _mm256_shuffle_epi8(window, prefix));
+        const __m256i wrap = _mm256_cmpeq_epi8(_mm256_max_epu8(sum, modulus), sum);
+        sum = _mm256_sub_epi8(sum, _mm256_and_si256(wrap, modulus));
+        sum = _mm256_add_epi8(sum, first);
+        sum = _mm256_or_si256(sum, _mm256_and_si256(input, case_bits));
+
+        _mm256_storeu_si256(chunk, _mm256_blendv_epi8(input, sum, letters));
+        position = advance(key, high, __builtin_popcount(mask >> 16));
     }
+    return transform_ssse3(data + i, length - i, key, position);
+}
+#endif
+
+// In byte mode there is nothing to classify, the shifts are simply added
+// with wrap-around, which the compiler vectorizes between key wraps.
+static size_t transform_bytes(char *data, size_t length,
+                              const key_schedule& key, size_t position) {
+    const unsigned char *shifts = key.shifts.data();
+    unsigned char *bytes = reinterpret_cast<unsigned char *>(data);
+    while (length > 0) {
+        const size_t count = std::min(length, key.period - position);
+        for (size_t i = 0; i < count; ++i)
+            bytes[i] += shifts[position + i];
+        bytes += count;
+        length -= count;
+        position = advance(key, position, count);
+    }
+    return position;
+}
+
+#ifdef VIGENERE_X86
+__attribute__((target("avx2")))
+static size_t transform_bytes_avx2(char *data, size_t length,
+                                   const key_schedule& key, size_t position) {
+    const unsigned char *shifts = key.shifts.data();
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i *chunk = reinterpret_cast<__m256i *>(data + i);
+        const __m256i window = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(shifts + position));
+        _mm256_storeu_si256(chunk, _mm256_add_epi8(_mm256_loadu_si256(chunk), window));
+        position = advance(key, position, 32);
+    }
+    return transform_bytes(data + i, length - i, key, position);
+}
+#endif
+
+// The autokey cipher uses the key for the first letters, then the text
+// itself, so each position of the key stream is overwritten by the letter of
+// the plaintext it was used for. It has to run strictly in order, but only
+// remembers the last key-length letters.
+template <typename Cipher, cipher_mode Mode>
+static size_t transform_autokey(char *data, size_t length,
+                                const key_schedule& key, size_t position) {
+    unsigned char *stream = key.stream.data();
+    const size_t key_length = key.stream.size();
+    for (size_t i = 0; i < length; ++i) {
+        const unsigned char current = data[i];
+        if (!is_letter(current))
+            continue;
+
+        const int letter = (current & 0xDF) - 'A';
+        const int result = Cipher::template apply<Mode>(letter, stream[position]);
+        stream[position] = (Mode == encrypt_mode) ? letter : result;
+        data[i] = ('A' + result) | (current & key.case_bits);
+        position = (position + 1 == key_length) ? 0 : position + 1;
+    }
+    return position;
+}
 
-    char current;
+typedef size_t (*transform_function)(char *, size_t, const key_schedule&, size_t);
+
+static transform_function select_transform(const key_schedule& key) {
+    if (key.cipher == autokey_type) {
+        return (key.mode == encrypt_mode)
+            ? transform_autokey<vigenere_policy, encrypt_mode>
+            : transform_autokey<vigenere_policy, decrypt_mode>;
+    }
+
+#ifdef VIGENERE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return key.bytes ? transform_bytes_avx2 : key.additive ? transform_avx2 : transform_table;
+    if (__builtin_cpu_supports("ssse3") && key.additive && !key.bytes)
+        return transform_ssse3;
+#endif
+    return key.bytes ? transform_bytes : transform_table;
+}
+
+static size_t count_letters(const key_schedule& key, const char *data, size_t length) {
+    if (key.bytes)
+        return length;
+
+    size_t count = 0;
+    for (size_t i = 0; i < length; ++i)
+        count += is_letter(data[i]);
+    return count;
+}
+
+static size_t skip(const key_schedule& key, size_t position, size_t letters) {
+    return (position + letters % key.period) % key.period;
+}
+
+static ssize_t read_block(int fd, char *buffer, size_t size) {
+    ssize_t result;
+    do {
+        result = read(fd, buffer, size);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+static ssize_t fill_block(int fd, char *buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        const ssize_t result = read_block(fd, buffer + total, size - total);
+        if (result < 0)
+            return -1;
+        if (result == 0)
+            break;
+        total += result;
+    }
+    return total;
+}
+
+static bool write_block(int fd, const char *buffer, size_t size) {
+    while (size > 0) {
+        const ssize_t result = write(fd, buffer, size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return false;
+        buffer += result;
+        size -= result;
+    }
+    return true;
+}
+
+// Validates UTF-8 incrementally, so that sequences may span blocks. Runs of
+// ASCII are skipped a vector at a time, and only the bytes of multibyte
+// sequences are checked one by one against the ranges of RFC 3629. Since
+// bytes above 0x7F are never letters, multibyte sequences pass through the
+// cipher unchanged, and only ASCII letters are encrypted.
+struct utf8_validator {
+    unsigned long long offset;
+    int remaining;
+    unsigned char lower;
+    unsigned char upper;
+};
+
+static size_t skip_ascii(const unsigned char *data, size_t length) {
+    size_t i = 0;
+#ifdef VIGENERE_X86
+    for (; i + 32 <= length; i += 32) {
+        const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(first, second)) != 0)
+            break;
+    }
+#endif
+    while (i < length && data[i] < 0x80)
+        ++i;
+    return i;
+}
+
+static bool validate_utf8(utf8_validator& validator, const char *text, size_t length) {
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(text);
+    size_t i = 0;
+    while (i < length) {
+        if (validator.remaining == 0) {
+            i += skip_ascii(data + i, length - i);
+            if (i == length)
+                break;
+
+            const unsigned char lead = data[i];
+            validator.lower = 0x80;
+            validator.upper = 0xBF;
+            if (lead >= 0xC2 && lead <= 0xDF) {
+                validator.remaining = 1;
+            } else if (lead >= 0xE0 && lead <= 0xEF) {
+                validator.remaining = 2;
+                if (lead == 0xE0)
+                    validator.lower = 0xA0;
+                if (lead == 0xED)
+                    validator.upper = 0x9F;
+            } else if (lead >= 0xF0 && lead <= 0xF4) {
+                validator.remaining = 3;
+                if (lead == 0xF0)
+                    validator.lower = 0x90;
+                if (lead == 0xF4)
+                    validator.upper = 0x8F;
+            } else {
+                validator.offset += i;
+                return false;
+            }
+        } else {
+            const unsigned char current = data[i];
+            if (current < validator.lower || current > validator.upper) {
+                validator.offset += i;
+                return false;
+            }
+            validator.lower = 0x80;
+            validator.upper = 0xBF;
+            --validator.remaining;
+        }
+        ++i;
+    }
+
+    validator.offset += length;
+    return true;
+}
+
+// The letter index records how many letters precede every checkpoint, which
+// are placed 'interval' bytes apart. Letters stay letters and everything
+// else stays unchanged, so the same index describes the plaintext and the
+// ciphertext, and tells the key position at each checkpoint of either.
+struct letter_index {
+    size_t interval;
+    unsigned long long offset;
+    unsigned long long letters;
+    std::vector<unsigned long long> checkpoints;
+};
+
+static const size_t index_interval = 1 << 20;
+
+static void update_index(letter_index& index, const key_schedule& key,
+                         const char *data, size_t length) {
+    while (length > 0) {
+        if (index.offset % index.interval == 0)
+            index.checkpoints.push_back(index.letters);
+
+        const size_t count = std::min<unsigned long long>(
+            length, index.interval - index.offset % index.interval);
+        index.letters += count_letters(key, data, count);
+        index.offset += count;
+        data += count;
+        length -= count;
+    }
+}
+
+static bool write_index(const char *path, const letter_index& index) {
+    std::ofstream file(path);
+    file << "vigenere-index " << index.interval << '\n';
+    for (unsigned long long checkpoint : index.checkpoints)
+        file << checkpoint << '\n';
+    file.close();
+    if (!file) {
+        std::cerr << "failed to write index: '" << path << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool read_index(const char *path, letter_index& index) {
+    std::ifstream file(path);
+    std::string magic;
+    if (!(file >> magic >> index.interval) || magic != "vigenere-index" || index.interval == 0) {
+        std::cerr << "failed to read index: '" << path << "'" << std::endl;
+        return false;
+    }
+
+    unsigned long long checkpoint;
+    while (file >> checkpoint)
+        index.checkpoints.push_back(checkpoint);
+    return true;
+}
+
+// Streams the input to the output through the given buffer. Returns null
+// on success, or a description of the failed step, with errno set.
+static const char * transform_stream(int input, int output, const key_schedule& key,
+                                     transform_function transform, char *buffer,
+                                     size_t size, unsigned long long& total,
+                                     utf8_validator *validator, letter_index *index) {
     size_t position = 0;
-    while (std::cin.get(current)) {
-        if (!isalpha(current)) {
-            std::cout.put(current);
+    for (;;) {
+        const ssize_t length = read_block(input, buffer, size);
+        if (length < 0)
+            return "failed to read input";
+        if (length == 0 && validator != nullptr && validator->remaining > 0) {
+            errno = EILSEQ;
+            return "truncated UTF-8 sequence at the end of the input";
+        }
+        if (length == 0)
+            return nullptr;
+
+        if (validator != nullptr && !validate_utf8(*validator, buffer, length)) {
+            errno = EILSEQ;
+            return "invalid UTF-8 sequence in the input";
+        }
+
+        if (index != nullptr)
+            update_index(*index, key, buffer, length);
+        position = transform(buffer, length, key, position);
+        if (!write_block(output, buffer, length))
+            return "failed to write output";
+        total += length;
+    }
+}
+
+static bool process_serial(int input, const key_schedule& key,
+                           transform_function transform,
+                           utf8_validator *validator, letter_index *index) {
+    std::vector<char> buffer(block_size);
+    unsigned long long total = 0;
+    const char *error = transform_stream(input, STDOUT_FILENO, key, transform,
+                                         buffer.data(), block_size, total,
+                                         validator, index);
+    if (error != nullptr && errno == EILSEQ) {
+        std::cerr << error << " at byte " << validator->offset << std::endl;
+        return false;
+    }
+    if (error != nullptr) {
+        std::cerr << error << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#ifdef __linux__
+// Instead of copying the output into the pipe, vmsplice() makes the pipe
+// refer to the pages of the buffer, so a buffer may only be refilled once
+// the reader has consumed it. Every buffer is filled to the capacity of the
+// pipe (except the last one), so by the time the next buffer has been
+// handed over entirely, the previous one must have left the pipe. A third
+// buffer is kept as a margin. Readers which splice the pages further
+// instead of reading them may observe the reuse, so this mode is opt-in.
+static bool process_splice(int input, const key_schedule& key,
+                           transform_function transform) {
+    struct stat status;
+    if (fstat(STDOUT_FILENO, &status) < 0 || !S_ISFIFO(status.st_mode))
+        return process_serial(input, key, transform, nullptr, nullptr);
+
+    fcntl(STDOUT_FILENO, F_SETPIPE_SZ, int(block_size));
+    const int capacity = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+    if (capacity <= 0)
+        return process_serial(input, key, transform, nullptr, nullptr);
+
+    static const size_t buffer_count = 3;
+    const size_t buffer_size = capacity;
+    void *memory = mmap(nullptr, buffer_count * buffer_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        std::cerr << "failed to allocate buffers: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    char *buffers = static_cast<char *>(memory);
+    size_t position = 0;
+    bool success = true;
+    for (size_t current = 0;; current = (current + 1) % buffer_count) {
+        char *buffer = buffers + current * buffer_size;
+        const ssize_t length = fill_block(input, buffer, buffer_size);
+        if (length < 0) {
+            std::cerr << "failed to read input: " << strerror(errno) << std::endl;
+            success = false;
+            break;
+        }
+        if (length == 0)
+            break;
+
+        position = transform(buffer, length, key, position);
+        struct iovec pending = { buffer, size_t(length) };
+        while (pending.iov_len > 0) {
+            const ssize_t result = vmsplice(STDOUT_FILENO, &pending, 1, 0);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result < 0) {
+                std::cerr << "failed to write output: " << strerror(errno) << std::endl;
+                munmap(memory, buffer_count * buffer_size);
+                return false;
+            }
+            pending.iov_base = static_cast<char *>(pending.iov_base) + result;
+            pending.iov_len -= result;
+        }
+
+        if (size_t(length) < buffer_size)
+            break;
+    }
+
+    munmap(memory, buffer_count * buffer_size);
+    return success;
+}
+#endif
+
+template <typename Function>
+static void run_parallel(size_t count, Function function) {
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < count; ++i)
+        workers.emplace_back(function, i);
+    if (count > 0)
+        function(0);
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+// The key only advances on letters, so the key position at the start of a
+// slice depends on everything before it. The data is split into one slice
+// per thread, the letters of every slice are counted in parallel, and a
+// prefix sum of the counts gives each slice its starting position, after
+// which all slices are encrypted in parallel.
+static size_t transform_parallel(char *data, size_t length,
+                                 const key_schedule& key,
+                                 transform_function transform,
+                                 size_t threads, size_t position) {
+    const size_t slice = (length + threads - 1) / threads;
+    const size_t used = (length + slice - 1) / slice;
+    std::vector<size_t> positions(used);
+
+    run_parallel(used, [&](size_t i) {
+        const size_t begin = i * slice;
+        positions[i] = count_letters(key, data + begin, std::min(slice, length - begin));
+    });
+
+    for (size_t i = 0; i < used; ++i) {
+        const size_t letters = positions[i];
+        positions[i] = position;
+        position = skip(key, position, letters);
+    }
+
+    run_parallel(used, [&](size_t i) {
+        const size_t begin = i * slice;
+        transform(data + begin, std::min(slice, length - begin), key, positions[i]);
+    });
+
+    return position;
+}
+
+// Reads a round of one chunk per thread at a time. Rounds are capped at
+// 'max_round_size', so with many threads every slice gets smaller instead of
+// the buffer growing.
+static bool process_parallel(int input, const key_schedule& key,
+                             transform_function transform, size_t threads,
+                             utf8_validator *validator, letter_index *index) {
+    const size_t round_size = std::min(threads * chunk_size, max_round_size);
+    std::vector<char> buffer(round_size);
+    size_t position = 0;
+
+    for (;;) {
+        const ssize_t length = fill_block(input, buffer.data(), round_size);
+        if (length < 0) {
+            std::cerr << "failed to read input: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (validator != nullptr && !validate_utf8(*validator, buffer.data(), length)) {
+            std::cerr << "invalid UTF-8 sequence in the input at byte "
+                      << validator->offset << std::endl;
+            return false;
+        }
+        if (validator != nullptr && size_t(length) < round_size && validator->remaining > 0) {
+            std::cerr << "truncated UTF-8 sequence at the end of the input at byte "
+                      << validator->offset << std::endl;
+            return false;
+        }
+        if (length == 0)
+            return true;
+
+        if (index != nullptr)
+            update_index(*index, key, buffer.data(), length);
+
+        position = transform_parallel(buffer.data(), length, key, transform,
+                                      threads, position);
+        if (!write_block(STDOUT_FILENO, buffer.data(), length)) {
+            std::cerr << "failed to write output: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (size_t(length) < round_size)
+            return true;
+    }
+}
+
+// Maps the whole file and encrypts it through the mapping, one round of
+// chunks at a time, so that each round is still cached between the counting
+// and the encrypting pass of the threaded mode.
+static bool process_in_place(const char *path, const key_schedule& key,
+                             transform_function transform, size_t threads) {
+    const int file = open(path, O_RDWR);
+    if (file < 0) {
+        std::cerr << "failed to open file: '" << path << "'" << std::endl;
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(file, &status) < 0 || !S_ISREG(status.st_mode)) {
+        std::cerr << "not a regular file: '" << path << "'" << std::endl;
+        close(file);
+        return false;
+    }
+
+    const size_t length = status.st_size;
+    if (length == 0) {
+        close(file);
+        return true;
+    }
+
+    void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "failed to map file: '" << path << "'" << std::endl;
+        return false;
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    char *data = static_cast<char *>(mapping);
+    const size_t round_size = std::min(threads * chunk_size, max_round_size);
+    size_t position = 0;
+    for (size_t offset = 0; offset < length; offset += round_size) {
+        const size_t current = std::min(round_size, length - offset);
+        position = (threads > 1)
+            ? transform_parallel(data + offset, current, key, transform, threads, position)
+            : transform(data + offset, current, key, position);
+    }
+
+    munmap(mapping, length);
+    return true;
+}
+
+static bool read_at(int file, char *buffer, size_t size, unsigned long long offset,
+                    size_t& length) {
+    length = 0;
+    while (length < size) {
+        const ssize_t result = pread(file, buffer + length, size - length, offset + length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return false;
+        if (result == 0)
+            break;
+        length += result;
+    }
+    return true;
+}
+
+// Transforms only the given range of a file. The key position at the start
+// of the range is found from the closest preceding checkpoint of the index,
+// if any, so at most one interval has to be scanned before the range. In
+// byte mode, the key position is simply the offset.
+static bool process_range(const char *path, const key_schedule& key,
+                          transform_function transform, const char *index_path,
+                          unsigned long long offset, unsigned long long length) {
+    letter_index index = { index_interval, 0, 0, {} };
+    if (index_path != nullptr && !read_index(index_path, index))
+        return false;
+
+    const int file = open(path, O_RDONLY);
+    if (file < 0) {
+        std::cerr << "failed to open file: '" << path << "'" << std::endl;
+        return false;
+    }
+
+    unsigned long long start = 0, letters = 0;
+    if (key.bytes) {
+        start = offset;
+        letters = offset;
+    } else if (!index.checkpoints.empty()) {
+        const size_t checkpoint = std::min<unsigned long long>(
+            offset / index.interval, index.checkpoints.size() - 1);
+        start = checkpoint * index.interval;
+        letters = index.checkpoints[checkpoint];
+    }
+
+    std::vector<char> buffer(block_size);
+    bool success = true;
+    while (success && start < offset) {
+        size_t count;
+        const size_t wanted = std::min<unsigned long long>(block_size, offset - start);
+        success = read_at(file, buffer.data(), wanted, start, count);
+        if (success && count == 0)
+            break;
+        letters += count_letters(key, buffer.data(), count);
+        start += count;
+    }
+
+    size_t position = skip(key, 0, letters);
+    while (success && length > 0) {
+        size_t count;
+        const size_t wanted = std::min<unsigned long long>(block_size, length);
+        success = read_at(file, buffer.data(), wanted, offset, count);
+        if (!success || count == 0)
+            break;
+
+        position = transform(buffer.data(), count, key, position);
+        if (!write_block(STDOUT_FILENO, buffer.data(), count)) {
+            std::cerr << "failed to write output: " << strerror(errno) << std::endl;
+            close(file);
+            return false;
+        }
+        offset += count;
+        length -= count;
+    }
+
+    if (!success)
+        std::cerr << "failed to read input: " << strerror(errno) << std::endl;
+    close(file);
+    return success;
+}
+
+static const double english_frequencies[26] = {
+    0.08167, 0.01492, 0.02782, 0.04253, 0.12702, 0.02228, 0.02015,
+    0.06094, 0.06966, 0.00153, 0.00772, 0.04025, 0.02406, 0.06749,
+    0.07507, 0.01929, 0.00095, 0.05987, 0.06327, 0.09056, 0.02758,
+    0.00978, 0.02360, 0.00150, 0.01974, 0.00074
+};
+
+typedef std::vector<unsigned long long> histogram;
+
+// Column histograms of a period are kept as 26 counters per column. Every
+// period up to half of the maximum divides a period in the upper half (some
+// power of two multiple of it), so only the upper half is counted while
+// streaming, and the lower half is folded from those afterwards.
+static histogram fold_histogram(const histogram& source, size_t source_period,
+                                size_t period) {
+    histogram result(period * 26);
+    for (size_t column = 0; column < source_period; ++column) {
+        for (size_t letter = 0; letter < 26; ++letter)
+            result[(column % period) * 26 + letter] += source[column * 26 + letter];
+    }
+    return result;
+}
+
+// Folds the histogram of a period from the counted multiple of it.
+static histogram fold_counted(const std::vector<histogram>& counted, size_t first_counted,
+                              size_t period) {
+    size_t source = period;
+    while (source < first_counted)
+        source *= 2;
+    return fold_histogram(counted[source], source, period);
+}
+
+static double index_of_coincidence(const histogram& counts, size_t period) {
+    double sum = 0.0;
+    for (size_t column = 0; column < period; ++column) {
+        unsigned long long total = 0, pairs = 0;
+        for (size_t letter = 0; letter < 26; ++letter) {
+            const unsigned long long count = counts[column * 26 + letter];
+            total += count;
+            pairs += count * (count - 1);
+        }
+        if (total > 1)
+            sum += double(pairs) / (double(total) * double(total - 1));
+    }
+    return sum / period;
+}
+
+static char recover_key_letter(const unsigned long long *counts) {
+    unsigned long long total = 0;
+    for (size_t letter = 0; letter < 26; ++letter)
+        total += counts[letter];
+
+    size_t best_shift = 0;
+    double best_score = 0.0;
+    for (size_t shift = 0; shift < 26; ++shift) {
+        double score = 0.0;
+        for (size_t letter = 0; letter < 26; ++letter) {
+            const double expected = total * english_frequencies[letter];
+            const double difference = counts[(letter + shift) % 26] - expected;
+            score += difference * difference / expected;
+        }
+        if (shift == 0 || score < best_score) {
+            best_shift = shift;
+            best_score = score;
+        }
+    }
+    return 'A' + best_shift;
+}
+
+// Builds the column histograms of every candidate period in a single pass
+// over the input. Letters of each block are first compacted into a list of
+// alphabet indices without branching, then the candidate periods are split
+// between the threads, each of which walks the whole list for its periods.
+static bool process_crack(int input, size_t max_period, size_t threads) {
+    const size_t first_counted = max_period / 2 + 1;
+    std::vector<histogram> counted(max_period + 1);
+    for (size_t period = first_counted; period <= max_period; ++period)
+        counted[period].resize(period * 26);
+
+    std::vector<char> buffer(chunk_size);
+    std::vector<unsigned char> letters(chunk_size + 1);
+    unsigned long long processed = 0;
+
+    for (;;) {
+        const ssize_t length = fill_block(input, buffer.data(), chunk_size);
+        if (length < 0) {
+            std::cerr << "failed to read input: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (length == 0)
+            break;
+
+        size_t count = 0;
+        for (ssize_t i = 0; i < length; ++i) {
+            const unsigned char index = (buffer[i] & 0xDF) - 'A';
+            letters[count] = index;
+            count += (index < 26);
+        }
+
+        const size_t workers = std::min(threads, max_period - first_counted + 1);
+        run_parallel(workers, [&](size_t worker) {
+            for (size_t period = first_counted + worker; period <= max_period; period += workers) {
+                unsigned long long *counts = counted[period].data();
+                size_t column = processed % period;
+                for (size_t i = 0; i < count; ++i) {
+                    ++counts[column * 26 + letters[i]];
+                    column = (column + 1 == period) ? 0 : column + 1;
+                }
+            }
+        });
+
+        processed += count;
+        if (size_t(length) < chunk_size)
+            break;
+    }
+
+    if (processed == 0) {
+        std::cerr << "input contains no letters" << std::endl;
+        return false;
+    }
+
+    // Folded histograms are only kept for as long as their index of
+    // coincidence is computed, and the chosen one is folded again below.
+    std::vector<double> coincidences(max_period + 1);
+    double best = 0.0;
+    for (size_t period = 1; period <= max_period; ++period) {
+        coincidences[period] = (period >= first_counted)
+            ? index_of_coincidence(counted[period], period)
+            : index_of_coincidence(fold_counted(counted, first_counted, period), period);
+        best = std::max(best, coincidences[period]);
+    }
+
+    // Multiples of the key length score about as well as the key length
+    // itself, so the shortest period close to the best score is chosen.
+    size_t period = 1;
+    while (coincidences[period] < 0.9 * best)
+        ++period;
+
+    const histogram chosen = fold_counted(counted, first_counted, period);
+    std::string key;
+    for (size_t column = 0; column < period; ++column)
+        key += recover_key_letter(&chosen[column * 26]);
+    std::cout << key << std::endl;
+    return true;
+}
+
+struct batch_entry {
+    cipher_mode mode;
+    std::string key;
+    std::string input;
+    std::string output;
+};
+
+static bool read_manifest(int input, std::vector<batch_entry>& entries) {
+    std::string contents;
+    std::vector<char> buffer(block_size);
+    for (;;) {
+        const ssize_t length = read_block(input, buffer.data(), block_size);
+        if (length < 0) {
+            std::cerr << "failed to read manifest: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (length == 0)
+            break;
+        contents.append(buffer.data(), length);
+    }
+
+    std::istringstream lines(contents);
+    std::string line;
+    for (size_t number = 1; std::getline(lines, line); ++number) {
+        std::istringstream fields(line);
+        std::string mode, extra;
+        batch_entry entry;
+        if (!(fields >> mode) || mode[0] == '#')
+            continue;
+
+        if (!(fields >> entry.key >> entry.input >> entry.output) || (fields >> extra)) {
+            std::cerr << "manifest line " << number
+                      << ": expected '<encrypt|decrypt> <key> <input> <output>'" << std::endl;
+            return false;
+        }
+
+        if (mode == "encrypt") {
+            entry.mode = encrypt_mode;
+        } else if (mode == "decrypt") {
+            entry.mode = decrypt_mode;
         } else {
-            current = toupper(current);
-            if (mode == encrypt_mode) {
-                std::cout.put(add(current, key[position++ % key_length]));
+            std::cerr << "manifest line " << number
+                      << ": mode must be either 'encrypt' or 'decrypt'" << std::endl;
+            return false;
+        }
+
+        if (!is_valid_key(entry.key.c_str())) {
+            std::cerr << "manifest line " << number
+                      << ": key must be a non-empty string of letters" << std::endl;
+            return false;
+        }
+
+        entries.push_back(entry);
+    }
+
+    return true;
+}
+
+// Files are told apart by device and inode. An output that does not exist
+// yet is identified by its directory and its name instead.
+struct file_identity {
+    dev_t device;
+    ino_t inode;
+    std::string name;
+    size_t entry;
+};
+
+static bool identify_file(const std::string& path, file_identity& identity) {
+    struct stat status;
+    identity.name.clear();
+    if (stat(path.c_str(), &status) < 0) {
+        const size_t slash = path.rfind('/');
+        const std::string directory = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+        if (stat(directory.c_str(), &status) < 0)
+            return false;
+        identity.name = path.substr(slash + 1);
+    }
+    identity.device = status.st_dev;
+    identity.inode = status.st_ino;
+    return true;
+}
+
+static bool identity_before(const file_identity& first, const file_identity& second) {
+    if (first.device != second.device)
+        return first.device < second.device;
+    if (first.inode != second.inode)
+        return first.inode < second.inode;
+    return first.name < second.name;
+}
+
+// The entries of a batch run concurrently, so no two of them may write the
+// same file, and no entry may write a file that any entry reads (its own
+// input included), as it would be truncated before it is read.
+static bool check_batch(const std::vector<batch_entry>& entries) {
+    std::vector<file_identity> outputs;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        file_identity identity;
+        identity.entry = i;
+        if (identify_file(entries[i].output, identity))
+            outputs.push_back(identity);
+    }
+
+    std::sort(outputs.begin(), outputs.end(), identity_before);
+    for (size_t i = 1; i < outputs.size(); ++i) {
+        if (!identity_before(outputs[i - 1], outputs[i])) {
+            std::cerr << "'" << entries[outputs[i].entry].output
+                      << "' is written by more than one entry" << std::endl;
+            return false;
+        }
+    }
+
+    for (const batch_entry& entry : entries) {
+        file_identity identity;
+        if (identify_file(entry.input, identity) &&
+            std::binary_search(outputs.begin(), outputs.end(), identity, identity_before)) {
+            std::cerr << "'" << entry.input << "' is both read and written by the batch"
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Processes the entries of a manifest on a pool of threads, each of which
+// owns one buffer and keeps taking the next unprocessed entry, so that the
+// cost per file is only opening the files and building the key schedule.
+static bool process_batch(int manifest, size_t threads) {
+    typedef std::chrono::steady_clock clock;
+    std::vector<batch_entry> entries;
+    if (!read_manifest(manifest, entries) || !check_batch(entries))
+        return false;
+
+    std::atomic<size_t> next(0);
+    std::atomic<unsigned long long> processed(0);
+    std::atomic<bool> success(true);
+    std::mutex report;
+    const clock::time_point start = clock::now();
+
+    run_parallel(std::min(threads, entries.size()), [&](size_t) {
+        std::vector<char> buffer(block_size);
+        for (size_t i = next++; i < entries.size(); i = next++) {
+            const batch_entry& entry = entries[i];
+            const clock::time_point begin = clock::now();
+            const key_schedule key = make_schedule(entry.key.c_str(), vigenere_type, entry.mode,
+                                                   false, false);
+            unsigned long long total = 0;
+            const char *error = nullptr;
+
+            const int input = open(entry.input.c_str(), O_RDONLY);
+            const int output = (input < 0) ? -1 :
+                open(entry.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (input < 0)
+                error = "failed to open input";
+            else if (output < 0)
+                error = "failed to open output";
+            else
+                error = transform_stream(input, output, key, select_transform(key),
+                                         buffer.data(), block_size, total,
+                                         nullptr, nullptr);
+
+            int code = errno;
+            if (output >= 0 && close(output) < 0 && error == nullptr) {
+                error = "failed to write output";
+                code = errno;
+            }
+            if (input >= 0)
+                close(input);
+
+            const std::chrono::duration<double> elapsed = clock::now() - begin;
+            std::lock_guard<std::mutex> lock(report);
+            if (error != nullptr) {
+                std::cerr << entry.input << ": " << error << ": " << strerror(code) << std::endl;
+                success = false;
             } else {
-                std::cout.put(subtract(current, key[position++ % key_length]));
+                std::cout << entry.input << " -> " << entry.output << ": " << total
+                          << " bytes, " << unsigned(total / elapsed.count() / (1 << 20))
+                          << " MB/s" << std::endl;
+                processed += total;
             }
         }
+    });
+
+    const std::chrono::duration<double> elapsed = clock::now() - start;
+    std::cout << "total: " << entries.size() << " files, " << processed << " bytes, "
+              << unsigned(processed / elapsed.count() / (1 << 20)) << " MB/s" << std::endl;
+    return success;
+}
+
+struct bench_path {
+    const char *name;
+    transform_function transform;
+    size_t threads;
+};
+
+static double measure(const bench_path& path, char *data, size_t length,
+                      const key_schedule& key) {
+    typedef std::chrono::steady_clock clock;
+    const clock::time_point start = clock::now();
+    if (path.threads > 1)
+        transform_parallel(data, length, key, path.transform, path.threads, 0);
+    else
+        path.transform(data, length, key, 0);
+    const std::chrono::duration<double> elapsed = clock::now() - start;
+    return length / elapsed.count() / (1 << 20);
+}
+
+// Generates text where 'density' percent of the bytes are letters of mixed
+// case and the rest are spaces, digits and punctuation, then encrypts and
+// decrypts it with every available implementation, checking that all of
+// them produce the same ciphertext and restore the (uppercased) text.
+static bool process_bench(size_t megabytes, size_t density, size_t threads) {
+    static const char others[] = " .,;:!?-0123456789\n";
+    const size_t length = megabytes << 20;
+    std::vector<char> text(length);
+    unsigned long long state = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < length; ++i) {
+        state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+        const unsigned value = state >> 32;
+        text[i] = (value % 100 < density)
+            ? char(((value >> 8) % 2 ? 'a' : 'A') + (value >> 16) % 26)
+            : others[(value >> 8) % (sizeof(others) - 1)];
+    }
+
+    std::vector<bench_path> paths;
+    paths.push_back(bench_path{ "table", transform_table, 1 });
+#ifdef VIGENERE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        paths.push_back(bench_path{ "ssse3", transform_ssse3, 1 });
+    if (__builtin_cpu_supports("avx2"))
+        paths.push_back(bench_path{ "avx2", transform_avx2, 1 });
+#endif
+    if (threads > 1)
+        paths.push_back(bench_path{ "threaded", paths.back().transform, threads });
+
+    const key_schedule encrypt_key = make_schedule("BENCHMARKKEY", vigenere_type,
+                                                   encrypt_mode, false, false);
+    const key_schedule decrypt_key = make_schedule("BENCHMARKKEY", vigenere_type,
+                                                   decrypt_mode, false, false);
+
+    std::vector<char> expected(text);
+    for (char& c : expected)
+        c = toupper(static_cast<unsigned char>(c));
+    std::vector<char> reference(text);
+    transform_table(reference.data(), length, encrypt_key, 0);
+
+    std::cout << "size: " << megabytes << " MiB, letters: " << density
+              << "%, threads: " << threads << std::endl;
+
+    bool success = true;
+    std::vector<char> data(length);
+    for (const bench_path& path : paths) {
+        std::copy(text.begin(), text.end(), data.begin());
+        const double encrypt_speed = measure(path, data.data(), length, encrypt_key);
+        const bool encrypted = (data == reference);
+        const double decrypt_speed = measure(path, data.data(), length, decrypt_key);
+        const bool decrypted = (data == expected);
+
+        std::cout << path.name << ": encrypt " << unsigned(encrypt_speed)
+                  << " MB/s, decrypt " << unsigned(decrypt_speed) << " MB/s";
+        if (!encrypted || !decrypted) {
+            std::cout << ", MISMATCH";
+            success = false;
+        }
+        std::cout << std::endl;
+    }
+
+    return success;
+}
+
+enum command {
+    cipher_command,
+    crack_command,
+    bench_command,
+    batch_command
+};
+
+struct options {
+    command action;
+    cipher_type cipher;
+    cipher_mode mode;
+    const char *key;
+    size_t threads;
+    bool in_place;
+    bool bytes;
+    bool preserve_case;
+    bool splice;
+    bool utf8;
+    const char *index;
+    bool range;
+    unsigned long long range_offset;
+    unsigned long long range_length;
+    size_t max_period;
+    size_t size;
+    size_t density;
+    const char *path;
+};
+
+static const char usage[] =
+    "usage: vigenere <encrypt|decrypt> <key> [OPTIONS] [file]\n"
+    "       vigenere crack [OPTIONS] [file]\n"
+    "       vigenere bench [OPTIONS]\n"
+    "       vigenere batch [OPTIONS] [manifest]\n"
+    "Encrypt or decrypt the file (or the standard input) with the given key,\n"
+    "recover the key of an English ciphertext, measure the throughput of\n"
+    "every implementation on generated text, or process every file listed in\n"
+    "a manifest, where each line reads '<encrypt|decrypt> <key> <input> <output>'.\n"
+    "\n"
+    "  --cipher NAME    one of 'vigenere' (default), 'beaufort',\n"
+    "                   'variant-beaufort' and 'autokey'\n"
+    "  --threads N      process large blocks on N threads (0: all cores)\n"
+    "  --in-place       transform the file in place instead of printing it\n"
+    "  --preserve-case  keep the case of letters instead of uppercasing them\n"
+    "  --bytes          shift every byte modulo 256 instead of only letters\n"
+    "  --splice         hand output pages to a pipe with vmsplice (Linux)\n"
+    "  --utf8           reject input which is not valid UTF-8\n"
+    "  --index FILE     write a letter index of the input while processing it,\n"
+    "                   or read it to find the start of the range quickly\n"
+    "  --range OFF:LEN  only process LEN bytes of the file from offset OFF\n"
+    "  --max-period N   longest key length tried when cracking (default: 32)\n"
+    "  --size N         amount of text generated when benchmarking, in MiB\n"
+    "  --density N      percentage of letters in the generated text";
+
+static bool parse_count(const char *arg, size_t limit, size_t& result) {
+    char *end;
+    result = strtoul(arg, &end, 10);
+    return *arg != '\0' && *end == '\0' && result <= limit;
+}
+
+static bool parse_arguments(int argc, char **argv, options& result) {
+    --argc, ++argv;
+    result.action = cipher_command;
+    if (argc >= 1 && strcmp(argv[0], "crack") == 0)
+        result.action = crack_command;
+    if (argc >= 1 && strcmp(argv[0], "bench") == 0)
+        result.action = bench_command;
+    if (argc >= 1 && strcmp(argv[0], "batch") == 0)
+        result.action = batch_command;
+
+    if (argc < (result.action == cipher_command ? 2 : 1)) {
+        std::cerr << usage << std::endl;
+        return false;
+    }
+
+    result.mode = encrypt_mode;
+    if (result.action != cipher_command) {
+        result.key = nullptr;
+    } else if (strcmp(argv[0], "encrypt") == 0) {
+        result.mode = encrypt_mode;
+        result.key = argv[1];
+    } else if (strcmp(argv[0], "decrypt") == 0) {
+        result.mode = decrypt_mode;
+        result.key = argv[1];
+    } else {
+        std::cerr << "mode must be one of 'encrypt', 'decrypt', 'crack', 'bench' and 'batch'"
+                  << std::endl;
+        return false;
+    }
+
+    result.cipher = vigenere_type;
+    result.threads = 1;
+    result.in_place = false;
+    result.bytes = false;
+    result.preserve_case = false;
+    result.splice = false;
+    result.utf8 = false;
+    result.index = nullptr;
+    result.range = false;
+    result.range_offset = 0;
+    result.range_length = 0;
+    result.max_period = 32;
+    result.size = 64;
+    result.density = 75;
+    result.path = nullptr;
+
+    for (int i = (result.action == cipher_command) ? 2 : 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--threads") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], 1024, result.threads)) {
+                std::cerr << "invalid thread count: '" << argv[i] << "'" << std::endl;
+                return false;
+            }
+            if (result.threads == 0)
+                result.threads = std::max(1u, std::thread::hardware_concurrency());
+        } else if (strcmp(arg, "--cipher") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, "vigenere") == 0) {
+                result.cipher = vigenere_type;
+            } else if (strcmp(name, "beaufort") == 0) {
+                result.cipher = beaufort_type;
+            } else if (strcmp(name, "variant-beaufort") == 0) {
+                result.cipher = variant_beaufort_type;
+            } else if (strcmp(name, "autokey") == 0) {
+                result.cipher = autokey_type;
+            } else {
+                std::cerr << "unknown cipher: '" << name << "'" << std::endl;
+                return false;
+            }
+        } else if (strcmp(arg, "--max-period") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], 1024, result.max_period) || result.max_period == 0) {
+                std::cerr << "invalid maximum period: '" << argv[i] << "'" << std::endl;
+                return false;
+            }
+        } else if (strcmp(arg, "--size") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], 65536, result.size) || result.size == 0) {
+                std::cerr << "invalid size: '" << argv[i] << "'" << std::endl;
+                return false;
+            }
+        } else if (strcmp(arg, "--density") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], 100, result.density)) {
+                std::cerr << "invalid density: '" << argv[i] << "'" << std::endl;
+                return false;
+            }
+        } else if (strcmp(arg, "--in-place") == 0) {
+            result.in_place = true;
+        } else if (strcmp(arg, "--bytes") == 0) {
+            result.bytes = true;
+        } else if (strcmp(arg, "--preserve-case") == 0) {
+            result.preserve_case = true;
+        } else if (strcmp(arg, "--splice") == 0) {
+            result.splice = true;
+        } else if (strcmp(arg, "--utf8") == 0) {
+            result.utf8 = true;
+        } else if (strcmp(arg, "--index") == 0 && i + 1 < argc) {
+            result.index = argv[++i];
+        } else if (strcmp(arg, "--range") == 0 && i + 1 < argc) {
+            char *end;
+            const char *range = argv[++i];
+            result.range_offset = strtoull(range, &end, 10);
+            bool valid = (end != range && *end == ':');
+            if (valid) {
+                const char *length = end + 1;
+                result.range_length = strtoull(length, &end, 10);
+                valid = (end != length && *end == '\0');
+            }
+            if (!valid) {
+                std::cerr << "invalid range: '" << argv[i] << "'" << std::endl;
+                return false;
+            }
+            result.range = true;
+        } else if (result.path == nullptr && (arg[0] != '-' || strcmp(arg, "-") == 0)) {
+            result.path = arg;
+        } else {
+            std::cerr << usage << std::endl;
+            return false;
+        }
+    }
+
+    const bool cipher_options = result.in_place || result.bytes || result.preserve_case ||
+        result.splice || result.utf8 || result.index != nullptr || result.range ||
+        result.cipher != vigenere_type;
+
+    if (result.action == bench_command) {
+        if (result.path != nullptr || cipher_options) {
+            std::cerr << "benchmarking only supports the letter cipher on generated text" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    if (result.action == crack_command) {
+        if (cipher_options) {
+            std::cerr << "cracking only supports the letter cipher" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    if (result.action == batch_command) {
+        if (cipher_options) {
+            std::cerr << "batch mode only supports the letter cipher" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    if (result.bytes && result.cipher != vigenere_type) {
+        std::cerr << "'--bytes' is only supported by the Vigenere cipher" << std::endl;
+        return false;
+    }
+
+    if (result.cipher == autokey_type && result.threads > 1) {
+        std::cerr << "the autokey cipher can't be split between threads" << std::endl;
+        return false;
+    }
+
+    if (result.utf8 && (result.bytes || result.in_place || result.splice)) {
+        std::cerr << "'--utf8' can't be combined with '--bytes', '--in-place' or '--splice'"
+                  << std::endl;
+        return false;
+    }
+
+    if ((result.index != nullptr || result.range) &&
+        (result.cipher == autokey_type || result.in_place || result.splice)) {
+        std::cerr << "'--index' and '--range' can't be combined with the autokey cipher, "
+                     "'--in-place' or '--splice'" << std::endl;
+        return false;
+    }
+
+    if (result.index != nullptr && result.bytes) {
+        std::cerr << "'--bytes' doesn't need an index" << std::endl;
+        return false;
+    }
+
+    if (result.range && (result.path == nullptr || strcmp(result.path, "-") == 0 ||
+                         result.threads > 1 || result.utf8)) {
+        std::cerr << "'--range' requires a file, and can't be combined with "
+                     "'--threads' or '--utf8'" << std::endl;
+        return false;
+    }
+
+    if (result.bytes && result.preserve_case) {
+        std::cerr << "'--bytes' and '--preserve-case' are mutually exclusive" << std::endl;
+        return false;
+    }
+
+    if (result.bytes && result.key[0] == '\0') {
+        std::cerr << "key must not be empty" << std::endl;
+        return false;
+    }
+
+    if (!result.bytes && !is_valid_key(result.key)) {
+        std::cerr << "key must be a non-empty string of letters" << std::endl;
+        return false;
+    }
+
+    if (result.splice && (result.in_place || result.threads > 1)) {
+        std::cerr << "'--splice' can't be combined with '--in-place' or '--threads'" << std::endl;
+        return false;
+    }
+
+    if (result.in_place && (result.path == nullptr || strcmp(result.path, "-") == 0)) {
+        std::cerr << "in-place mode requires a file" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    options settings;
+    if (!parse_arguments(argc, argv, settings))
+        return 1;
+
+    if (settings.action == bench_command)
+        return process_bench(settings.size, settings.density, settings.threads) ? 0 : 1;
+
+    int input = STDIN_FILENO;
+    if (!settings.in_place && settings.path != nullptr && strcmp(settings.path, "-") != 0) {
+        input = open(settings.path, O_RDONLY);
+        if (input < 0) {
+            std::cerr << "failed to open file: '" << settings.path << "'" << std::endl;
+            return 1;
+        }
+    }
+
+    bool success;
+    if (settings.action == crack_command) {
+        success = process_crack(input, settings.max_period, settings.threads);
+    } else if (settings.action == batch_command) {
+        success = process_batch(input, settings.threads);
+    } else {
+        const key_schedule key = make_schedule(settings.key, settings.cipher, settings.mode,
+                                               settings.bytes, settings.preserve_case);
+        const transform_function transform = select_transform(key);
+        utf8_validator utf8 = { 0, 0, 0x80, 0xBF };
+        utf8_validator *validator = settings.utf8 ? &utf8 : nullptr;
+        letter_index letters = { index_interval, 0, 0, {} };
+        letter_index *index = (settings.index != nullptr) ? &letters : nullptr;
+
+        if (settings.range)
+            success = process_range(settings.path, key, transform, settings.index,
+                                    settings.range_offset, settings.range_length);
+        else if (settings.in_place)
+            success = process_in_place(settings.path, key, transform, settings.threads);
+#ifdef __linux__
+        else if (settings.splice)
+            success = process_splice(input, key, transform);
+#endif
+        else if (settings.threads > 1)
+            success = process_parallel(input, key, transform, settings.threads,
+                                       validator, index);
+        else
+            success = process_serial(input, key, transform, validator, index);
+
+        if (success && index != nullptr && !settings.range)
+            success = write_index(settings.index, *index);
     }
 
-    return 0;
+    if (input != STDIN_FILENO)
+        close(input);
+    return success ? 0 : 1;
 }